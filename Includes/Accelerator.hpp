@@ -0,0 +1,17 @@
+#pragma once
+#include "Geometry.hpp"
+
+// Spatial index over primitives of a Geometry. Film only traces rays through this
+// interface, the scene picks the structure (see Scene::buildAccelerator).
+class Accelerator
+{
+public:
+	enum class Type { BVH, KdTree, Grid, Auto };
+
+	virtual ~Accelerator() {}
+
+	virtual const char* Name() const = 0;
+	virtual Bbox WorldBound() const = 0;
+	// closest hit in front of the ray origin and its primitive id, false when nothing is hit
+	virtual bool Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const = 0;
+};
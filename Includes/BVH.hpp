@@ -1,23 +1,71 @@
 #pragma once
 #include <vector>
 #include <memory>
-#include "Object.hpp"
+#include <cstdint>
+#include <cmath>
+#include "Accelerator.hpp"
 
 struct BVHBuildNode;
+struct CompressedBVHNode;
+struct PacketRay;
 
-class BVHAccel {
+class BVHAccel : public Accelerator {
 public:
-	enum class SplitMethod { Naive, SAH };
-	BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, vec3* vertex);
+	enum class NodeLayout { DepthFirst, VanEmdeBoas };
+	enum class Traversal { Stack, Stackless };
+	// interior levels the traversal stacks hold; deeper trees are not used
+	static const int MaxDepth = 64;
+	// the tree is built with a primitive per leaf, flattening merges subtrees of up to
+	// maxPrimsInNode (at most CompressedBVHNode::MaxLeafPrims) primitives into one leaf
+	BVHAccel(const Geometry* geometry, std::vector<uint32_t> p, int maxPrimsInNode, bool optimize = false);
+	BVHAccel(const Geometry* geometry, std::vector<uint32_t> p, const CompressedBVHNode* flatNodes, uint32_t nFlatNodes, const Bbox& worldBound);
 	~BVHAccel();
 
+	const char* Name() const override { return "BVH"; }
+	Bbox WorldBound() const override { return bounds; }
+	bool Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const override;
+	void intersectStack(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirIsNeg, float& hitDistance, uint32_t& hitPrim) const;
+	void intersectStackless(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirIsNeg, float& hitDistance, uint32_t& hitPrim) const;
+
 	BVHBuildNode* root;
 
-	BVHBuildNode* recursiveBuild(std::vector<Object*> objects, vec3* vertex);
+	BVHBuildNode* recursiveBuild(std::vector<uint32_t> objects);
+	uint32_t flattenBVHTree(BVHBuildNode* node, std::vector<uint32_t>& orderedPrims);
+	void deleteBVHTree(BVHBuildNode* node);
+
+	// post-build optimization of the pointer tree (BVHOptimize.cpp)
+	void optimizeBVHTree();
+	float computeSAHCost(BVHBuildNode* node);
+	static int treeDepth(const BVHBuildNode* node);
+	void reinsertNodes(float fraction);
+	void restructureTreelets(BVHBuildNode* node, int maxTreeletLeaves);
+
+	// memory order of the flattened nodes (BVHLayout.cpp), flattening leaves them depth first
+	void reorderNodes(NodeLayout layout);
+	// parents[i] = parent of nodes[i] << 1 | its child slot there, for stackless traversal
+	void buildParentLinks();
+	void setTraversal(Traversal mode);
+	// interior levels of a flattened tree, -1 when a child index is out of range or
+	// the nodes are not a tree (a node reached twice)
+	static int flatTreeDepth(const CompressedBVHNode* nodes, uint32_t nNodes, uint32_t nPrims);
+
+	// closest or any hit of up to 32 rays of one direction octant, traversed together (RayQuery.cpp)
+	void intersectPacket(PacketRay* rays, int n) const;
 
 	const int maxPrimsInNode;
-	const SplitMethod splitMethod;
-	std::vector<Object*> primitives;
+	Traversal traversal = Traversal::Stack;
+	const Geometry* geometry;
+	std::vector<uint32_t> primitives; // ids in leaf order once the tree is flattened
+	std::vector<Bbox> primBounds;     // by id, only while building
+	std::vector<vec3> primCentroids;
+
+	// traversal layout: nodeArray[0] is the root, bounds is the full precision root box.
+	// nodeArray points into nodes, or at nodes owned by someone else (a compiled scene)
+	Bbox bounds;
+	std::vector<CompressedBVHNode> nodes;
+	const CompressedBVHNode* nodeArray = nullptr;
+	uint32_t nodeCount = 0;
+	std::vector<uint32_t> parents;
 };
 
 struct BVHBuildNode
@@ -25,13 +73,52 @@ struct BVHBuildNode
 	Bbox bounds;
 	BVHBuildNode* left;
 	BVHBuildNode* right;
-	Object* object;
+	BVHBuildNode* parent; // only maintained by the optimization passes
+	uint32_t prim;
 
 	int splitAxis = 0, firstPrimOffset = 0, nPrimitive = 0;
+	float cost = 0.0f; // SAH cost of the subtree, unnormalized
 
 	BVHBuildNode() {
 		bounds = Bbox();
-		left = nullptr, right = nullptr;
-		object = nullptr;
+		left = nullptr, right = nullptr, parent = nullptr;
+		prim = 0;
+	}
+};
+
+// Interior node of the flattened BVH. The bounds of both children are stored as
+// 8-bit offsets in the node's own frame: plane = origin + q * 2^exponent, rounded
+// outwards so the decoded boxes always contain the exact ones. 36 bytes per interior
+// node, against 64 bytes for every interior and leaf BVHBuildNode.
+struct CompressedBVHNode
+{
+	static const uint32_t LeafFlag = 0x80000000u;
+	static const int LeafCountShift = 27;
+	static const uint32_t MaxLeafPrims = 16;
+	static const uint32_t PrimOffsetMask = (1u << LeafCountShift) - 1;
+
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t splitAxis;
+	uint8_t qMin[2][3];
+	uint8_t qMax[2][3];
+	// interior child: index into nodes
+	// leaf child: LeafFlag | (nPrimitive - 1) << LeafCountShift | firstPrimOffset
+	uint32_t child[2];
+
+	bool isLeaf(int i) const { return (child[i] & LeafFlag) != 0; }
+	uint32_t leafPrimOffset(int i) const { return child[i] & PrimOffsetMask; }
+	uint32_t leafPrimCount(int i) const { return ((child[i] & ~LeafFlag) >> LeafCountShift) + 1; }
+
+	Bbox childBounds(int i) const
+	{
+		Bbox b;
+		for (int a = 0; a < 3; a++)
+		{
+			float scale = std::ldexp(1.0f, exponent[a]);
+			b.pMin[a] = origin[a] + qMin[i][a] * scale;
+			b.pMax[a] = origin[a] + qMax[i][a] * scale;
+		}
+		return b;
 	}
-};
\ No newline at end of file
+};
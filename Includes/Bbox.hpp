@@ -60,9 +60,42 @@ public:
 	}
 
 	inline bool IntersectionP(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirisNeg) const;
+	// also rejects boxes entered beyond tMax (e.g. farther than the closest hit so far)
+	inline bool IntersectionP(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirisNeg, float tMax) const;
+	// parametric range of the ray inside the box, clipped to t >= 0
+	inline bool IntersectionP(const Ray& ray, float& tEnter, float& tExit) const;
 };
 
+inline bool Bbox::IntersectionP(const Ray& ray, float& tEnter, float& tExit) const
+{
+	float t0 = 0.0f, t1 = std::numeric_limits<float>::max();
+	for (int a = 0; a < 3; a++)
+	{
+		if (ray.direction[a] == 0.0f)
+		{
+			if (ray.origin[a] < pMin[a] || ray.origin[a] > pMax[a]) return false;
+			continue;
+		}
+		float invDir = 1.0f / ray.direction[a];
+		float tNear = (pMin[a] - ray.origin[a]) * invDir;
+		float tFar = (pMax[a] - ray.origin[a]) * invDir;
+		if (tNear > tFar) std::swap(tNear, tFar);
+		tFar *= 1.0000004f; // conservative against rounding, as in pbrt
+		t0 = tNear > t0 ? tNear : t0;
+		t1 = tFar < t1 ? tFar : t1;
+		if (t0 > t1) return false;
+	}
+	tEnter = t0;
+	tExit = t1;
+	return true;
+}
+
 inline bool Bbox::IntersectionP(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirisNeg) const
+{
+	return IntersectionP(ray, invDir, dirisNeg, std::numeric_limits<float>::max());
+}
+
+inline bool Bbox::IntersectionP(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirisNeg, float tMax) const
 {
 	float min_x = std::numeric_limits<float>::lowest();
 	float max_x = std::numeric_limits<float>::max();
@@ -95,7 +128,7 @@ inline bool Bbox::IntersectionP(const Ray& ray, const vec3& invDir, const std::a
 	float enter = std::max(min_x, std::max(min_y, min_z));
 	float exit = std::min(max_x, std::min(max_y, max_z));
 
-	if (enter <= exit && exit >= 0)
+	if (enter <= exit && exit >= 0 && enter <= tMax)
 		return true;
 	else
 		return false;
@@ -1,6 +1,15 @@
 #pragma once
+#include <string>
 #include "Ray.hpp"
 
+// a camera command of the scene and the image rendered from it
+struct View
+{
+	vec3 eye, center, up;
+	float fovy;
+	std::string output;
+};
+
 class Camera
 {
 private:
@@ -34,4 +43,14 @@ public:
 		vec3 dir = glm::normalize(alpha * u + beta * v - w);
 		return Ray(eye, dir);
 	}
+
+	// ray through any point of the image plane, in pixels: (x + 0.5, y + 0.5) is the
+	// center of pixel (x, y)
+	Ray RayThruPoint(float px, float py)
+	{
+		float alpha = tan(glm::radians(fovy * 0.5f)) * (2 * px - width) / height;
+		float beta = tan(glm::radians(fovy * 0.5f)) * (height - 2 * py) / height;
+		vec3 dir = glm::normalize(alpha * u + beta * v - w);
+		return Ray(eye, dir);
+	}
 };
\ No newline at end of file
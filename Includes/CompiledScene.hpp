@@ -0,0 +1,92 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Scene.hpp"
+#include "Camera.hpp"
+#include "MappedFile.hpp"
+#include "PageCache.hpp"
+
+// Binary form of a parsed scene, written by --compile and loaded by passing it in
+// place of the .test file. All arrays are aligned so they can be used straight from
+// the mapped file. The byte order and float format are those of the machine that
+// compiled it, the file is a cache of the .test scene, not an exchange format.
+struct CompiledSceneHeader
+{
+	static const uint32_t Version = 3;
+
+	char magic[8]; // "HHSCENE"
+	uint32_t version;
+	int32_t width, height, maxDepth;
+	float attenuation[3];
+
+	uint32_t nViews, nVertices, nTriangles, nMeshes, nSpheres, nMaterials, nTransforms, nLights, nBVHNodes, nBVHPrimitives;
+	float bvhBounds[6];
+
+	// byte offsets of the arrays from the start of the file
+	uint64_t viewOffset;         // CompiledSceneView[nViews]
+	uint64_t vertexOffset;       // vec3[nVertices], world space
+	uint64_t indexOffset;        // uint32_t[3 * nTriangles], the vertices of each triangle
+	uint64_t triangleMeshOffset; // uint32_t[nTriangles], the mesh of each triangle
+	uint64_t meshOffset;         // CompiledSceneMesh[nMeshes]
+	uint64_t sphereOffset;       // CompiledSceneSphere[nSpheres]
+	uint64_t materialOffset;     // Material[nMaterials]
+	uint64_t transformOffset;    // mat4[nTransforms]
+	uint64_t lightOffset;        // CompiledSceneLight[nLights]
+	uint64_t bvhOffset;          // CompressedBVHNode[nBVHNodes]
+	uint64_t bvhPrimitiveOffset; // uint32_t[nBVHPrimitives], primitive ids in leaf order
+};
+
+struct CompiledSceneView
+{
+	float eye[3], center[3], up[3], fovy;
+	char output[256];
+};
+
+struct CompiledSceneMesh
+{
+	uint32_t material;
+	uint32_t transform;
+};
+
+struct CompiledSceneSphere
+{
+	uint32_t material;
+	uint32_t transform;
+	float sphere[4]; // center and radius
+};
+
+struct CompiledSceneLight
+{
+	float color[3];
+	float position[4];
+};
+
+class CompiledScene
+{
+public:
+	// maps filename, false if it is no compiled scene (a .test file)
+	bool open(const char* filename);
+	bool isOpen() const { return header != nullptr; }
+
+	// the parser's counterpart: sets the views and render globals, points the
+	// vertex, index and mesh id buffers of geometry into the file and fills its
+	// meshes, spheres and lights from the tables
+	void load(Geometry& geometry, std::vector<Light>& lights);
+
+	bool hasBVH() const { return header->nBVHNodes > 0; }
+	// the stored BVH over the geometry it was loaded into
+	BVHAccel* createBVH(const Geometry* geometry) const;
+
+	// page the mapped buffers of geometry and the BVH in and out under a budget
+	// instead of keeping all that was read resident
+	void streamGeometry(Geometry& geometry, size_t budgetBytes);
+	const PageCache* pages() const { return pageCache.get(); }
+
+	// scene as parsed and its views, with the BVH if the accelerator is one
+	static bool write(const char* filename, const Scene& scene, const std::vector<View>& views);
+
+private:
+	MappedFile file;
+	const CompiledSceneHeader* header = nullptr;
+	std::unique_ptr<PageCache> pageCache;
+};
@@ -0,0 +1,11 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "Job.hpp"
+
+// --distribute: renders one scene with several worker processes, standing in for the
+// machines of a farm. The scene is compiled once, unless it already is, the image is
+// cut into bands of rows, and each worker renders the next band not yet taken with
+// --tile, to a partial framebuffer, until none is left. The parts are then merged
+// into the outputs of the views. optionArgs are passed on to every worker
+int distribute(const char* self, int workers, const char* sceneFile, const std::vector<std::string>& optionArgs, const Options& options);
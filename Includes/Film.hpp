@@ -1,35 +1,96 @@
 #pragma once
 #include <FreeImage.h>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <csignal>
 #include "Camera.hpp"
 #include "Scene.hpp"
 #include "Intersection.hpp"
 
-typedef std::pair<bool, float> PII;
+// square block of the image, x1 and y1 excluded
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
 
 class Film {
+public:
+	// order of the tiles in a pass and of the pixels in a tile. Along the curves,
+	// successive rays are close on the image and tend to visit the same BVH nodes
+	enum class TileOrder { Scan, Hilbert };
+	enum class PixelOrder { Scan, Morton };
+
 private:
 	int w, h;
 	BYTE* pixels;
 
-	const char* outputFilename;
+	const char* outputFilename = nullptr; // no file is written without one
+	Tile region;                          // the part of the image rendered, all by default
+	std::function<void(const Tile&)> tileDone;
 
 	Scene* myActiveScene = nullptr;
 	Camera* myActiveCamera = nullptr;
 
+	// progressive mode: passes of 1/8, 1/4, 1/2 and full resolution, each pixel traced
+	// once. Stops after timeBudget and writes the image so far every previewInterval
+	// seconds when they are not 0
+	bool progressive = false;
+	float timeBudget = 0.0f;
+	float previewInterval = 0.0f;
+
+	// cost schedule: the 1/8 pass, kept in the image, times its one sample per 8x8
+	// block, and the later passes run the tiles costliest first with the costly ones
+	// split into their blocks, so no thread is left with a heavy tile at the end
+	TileOrder tileOrder = TileOrder::Scan;
+	PixelOrder pixelOrder = PixelOrder::Scan;
+	bool costSchedule = true;
+	std::vector<float> blockCost; // seconds, blocks row by row
+
+	// adaptive anti-aliasing: a pass after the full resolution one gives the pixels
+	// whose neighbours differ by more than aaThreshold up to aaMaxSamples samples.
+	// Off while aaMaxSamples is 1
+	int aaMaxSamples = 1;
+	float aaThreshold = 0.03f;
+	std::vector<vec3> baseColor; // the one sample per pixel, kept for the neighbour test
+	std::atomic<size_t> aaPixels{ 0 }, aaSamples{ 0 };
+
+	// checkpoints: the stage each 8x8 block of the region reached, 1 after the full
+	// resolution pass and 2 after anti-aliasing, saved with the framebuffer between
+	// batches every checkpointInterval seconds and when a stop is requested. Resuming
+	// loads the checkpoint and renders the blocks it has not finished
+	const char* checkpointFilename = nullptr;
+	float checkpointInterval = 0.0f;
+	bool resume = false;
+	uint64_t checkpointScene = 0;
+	float checkpointCamera[10] = {}; // eye, center, up, fovy
+	std::vector<uint8_t> blockStage;
+
 	vec3 FindColor(Ray ray, int currDepth = 0);
 
-	Intersection TraceRay(Ray ray, BVHAccel* root);
-	Intersection ClosestHitSphere(Ray ray, float hitDistance, Object* closestSphere);
-	Intersection ClosestHitTriangle(Ray ray, float hitDistance, Object* closestTriangle, vec3* vertices);
+	Intersection TraceRay(Ray ray);
+	Intersection ClosestHitSphere(Ray ray, float hitDistance, uint32_t closestSphere);
+	Intersection ClosestHitTriangle(Ray ray, float hitDistance, uint32_t closestTriangle);
 	Intersection Miss(Ray ray);
 
-	Intersection findIntersection(Ray ray, Object* object);
-	Intersection getIntersection(BVHBuildNode* node, Ray ray);
+	void StorePixel(int x, int y, vec3 color);
+	void RenderPixel(int x, int y);
+	size_t RenderTile(const Tile& tile, int stride, int previousStride);
+	void RenderTileAA(const Tile& tile);
+	void TraceApron();
+	std::vector<Tile> ScheduleTiles(const std::vector<Tile>& tiles, size_t nThreads) const;
+	int BlockIndex(int x, int y) const;
+	void MarkBlocks(const Tile& tile, uint8_t stage);
+	std::vector<Tile> PendingTiles(const std::vector<Tile>& tiles, uint8_t stage) const;
+	bool WriteCheckpoint() const;
+	bool ReadCheckpoint();
 
 public:
 	Film(int _w, int _h) {
 		w = _w, h = _h;
-		pixels = new BYTE[3 * w * h];
+		pixels = new BYTE[3 * w * h](); // black where nothing is rendered
+		region = { 0, 0, w, h };
 	}
 
 	~Film() {
@@ -37,5 +98,54 @@ public:
 	}
 
 	void setOutputFilename(const char* filename) { outputFilename = filename; }
+	// tiles are laid out from the corner of the region, it is clipped to the image
+	void setRegion(const Tile& r)
+	{
+		region = { std::max(r.x0, 0), std::max(r.y0, 0), std::min(r.x1, w), std::min(r.y1, h) };
+	}
+	// called from the tracing threads with each tile of the region once its last pass
+	// is done, or once the time budget stopped the render
+	void setTileCallback(std::function<void(const Tile&)> callback) { tileDone = std::move(callback); }
+	// color of a pixel, blue green red
+	const BYTE* pixel(int x, int y) const { return &pixels[3 * (x + y * w)]; }
+	void WriteImage() const;
+	// Partial framebuffer: the region as a binary PPM, whose header comment holds its
+	// place in the image, "# HeliosHunter part x0 y0 x1 y1 of w h". ReadPart copies
+	// one into this film, false when it cannot be read or is of another image size
+	bool WritePart(const char* filename) const;
+	bool ReadPart(const char* filename);
+	void setProgressive(float timeBudgetSeconds, float previewIntervalSeconds)
+	{
+		progressive = true;
+		timeBudget = timeBudgetSeconds;
+		previewInterval = previewIntervalSeconds;
+	}
+	void setTileSchedule(bool byCost) { costSchedule = byCost; }
+	void setOrder(TileOrder tiles, PixelOrder pixelsInTile)
+	{
+		tileOrder = tiles;
+		pixelOrder = pixelsInTile;
+	}
+	void setAntiAliasing(int maxSamples, float threshold)
+	{
+		aaMaxSamples = maxSamples;
+		aaThreshold = threshold;
+	}
+	// checkpoints to filename, continuing from it when resuming. It is removed once the
+	// render is complete. A checkpoint of another scene, by sceneHash, or of another
+	// view of it is not resumed
+	void setCheckpoint(const char* filename, float intervalSeconds, bool resumeFromFile, uint64_t sceneHash, const View& view)
+	{
+		checkpointFilename = filename;
+		checkpointInterval = intervalSeconds;
+		resume = resumeFromFile;
+		checkpointScene = sceneHash;
+		const float camera[10] = { view.eye.x, view.eye.y, view.eye.z, view.center.x, view.center.y, view.center.z,
+			view.up.x, view.up.y, view.up.z, view.fovy };
+		std::copy(camera, camera + 10, checkpointCamera);
+	}
+	// set from a signal handler: renders stop after their current batch, and save a
+	// checkpoint when they keep them
+	static volatile std::sig_atomic_t stopRequested;
 	void Render(Scene scene, Camera camera);
 };
\ No newline at end of file
@@ -0,0 +1,129 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "Object.hpp"
+#include "PageCache.hpp"
+
+// vertex position as a fraction of the geometry's bounds, 65535 steps per axis
+struct QuantizedVertex
+{
+	uint16_t q[3];
+};
+
+// Every primitive of the scene under one id, 0 .. size() - 1: the triangles of all
+// meshes first, then the spheres. A triangle is three 32-bit indices into the world
+// space vertex buffer plus the id of its mesh, 16 bytes instead of a whole object.
+// The buffers are views, they point into the owned vectors below or into a mapped
+// compiled scene. Meshes and spheres refer to their material and transform by index,
+// each distinct one is stored once.
+// The arrays are split by use: intersect() only reads the hot ones, the shading of a
+// hit and the loading read the cold ones, so the leaf loops of the accelerators only
+// pull geometry into the cache.
+class Geometry
+{
+public:
+	// hot, read for every intersection test
+	vec3* vertices = nullptr;
+	QuantizedVertex* quantizedVertices = nullptr; // used instead of vertices once quantized
+	vec3 quantizedOrigin = vec3(0.0f), quantizedScale = vec3(0.0f);
+	uint32_t* indices = nullptr; // 3 per triangle
+	uint32_t numVertices = 0;
+	uint32_t numTriangles = 0;
+	std::vector<Sphere> spheres;
+	std::vector<mat4> inverseTransforms; // spheres are intersected in object space
+
+	// cold, read once per hit or while loading
+	uint32_t* triangleMesh = nullptr;     // mesh of each triangle
+	std::vector<uint32_t> sphereMaterial; // material of each sphere
+	std::vector<TriangleMesh> meshes;
+	std::vector<Material> materials;
+	std::vector<mat4> transforms;
+
+	// set when the buffers are paged from a compiled scene under a memory budget,
+	// every read of them is stamped
+	PageCache* pageCache = nullptr;
+
+	// storage of the views when the geometry was parsed
+	std::vector<vec3> vertexStorage;
+	std::vector<uint32_t> indexStorage;
+	std::vector<uint32_t> triangleMeshStorage;
+	std::vector<QuantizedVertex> quantizedStorage;
+
+	void useStorage()
+	{
+		vertices = vertexStorage.data();
+		indices = indexStorage.data();
+		triangleMesh = triangleMeshStorage.data();
+		numVertices = (uint32_t)vertexStorage.size();
+		numTriangles = (uint32_t)triangleMeshStorage.size();
+	}
+
+	// index of the table entry, added on first use; equal means bitwise equal
+	uint32_t addMaterial(const Material& material)
+	{
+		return intern(materials, materialIds, material);
+	}
+	uint32_t addTransform(const mat4& transform)
+	{
+		uint32_t id = intern(transforms, transformIds, transform);
+		if (id == inverseTransforms.size()) inverseTransforms.push_back(glm::inverse(transform));
+		return id;
+	}
+
+	// weld vertices with equal positions, drop zero area and repeated triangles and
+	// spheres, report the counts (GeometryCleanup.cpp). Renumbers the primitives
+	void cleanup();
+	// replace the float vertices by 16-bit ones over the bounds of all vertices, half
+	// the memory (VertexQuantization.cpp). The accelerators built afterwards see the
+	// decoded positions, so their bounds hold every triangle that is tested
+	void quantizeVertices();
+
+	vec3 vertex(uint32_t v) const
+	{
+		if (quantizedVertices == nullptr) return vertices[v];
+		const uint16_t* q = quantizedVertices[v].q;
+		return quantizedOrigin + vec3(q[0], q[1], q[2]) * quantizedScale;
+	}
+
+	uint32_t size() const { return numTriangles + (uint32_t)spheres.size(); }
+	bool isTriangle(uint32_t prim) const { return prim < numTriangles; }
+	const Sphere& sphere(uint32_t prim) const { return spheres[prim - numTriangles]; }
+	const Material& material(uint32_t prim) const
+	{
+		if (pageCache != nullptr && isTriangle(prim)) pageCache->touch(triangleMesh + prim);
+		return materials[isTriangle(prim) ? meshes[triangleMesh[prim]].material : sphereMaterial[prim - numTriangles]];
+	}
+
+	Bbox bounds(uint32_t prim) const
+	{
+		if (!isTriangle(prim)) return sphere(prim).getObjectBbox(transforms[sphere(prim).transform]);
+		const uint32_t* v = indices + 3 * (size_t)prim;
+		return Union(Bbox(vertex(v[0]), vertex(v[1])), vertex(v[2]));
+	}
+
+	PII intersect(const Ray& ray, uint32_t prim) const
+	{
+		if (!isTriangle(prim)) return RaySphereIntersect(ray, &sphere(prim), inverseTransforms[sphere(prim).transform]);
+		const uint32_t* v = indices + 3 * (size_t)prim;
+		if (pageCache != nullptr)
+		{
+			pageCache->touch(v);
+			for (int k = 0; k < 3; k++)
+				pageCache->touch(vertices + v[k]);
+		}
+		return RayTriangleIntersect(ray, vertex(v[0]), vertex(v[1]), vertex(v[2]));
+	}
+
+private:
+	std::unordered_map<std::string, uint32_t> materialIds, transformIds;
+
+	template <typename T>
+	static uint32_t intern(std::vector<T>& table, std::unordered_map<std::string, uint32_t>& ids, const T& value)
+	{
+		auto it = ids.emplace(std::string((const char*)&value, sizeof(T)), (uint32_t)table.size()).first;
+		if (it->second == table.size()) table.push_back(value);
+		return it->second;
+	}
+};
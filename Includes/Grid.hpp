@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Accelerator.hpp"
+
+// Uniform grid walked with a 3D DDA (Amanatides & Woo). The resolution follows the
+// object count, about three voxels per cube root of the count along the longest axis.
+// Objects overlapping several voxels are tested once per ray through a mailbox.
+class GridAccel : public Accelerator {
+public:
+	GridAccel(const Geometry* geometry, std::vector<uint32_t> p);
+
+	const char* Name() const override { return "grid"; }
+	Bbox WorldBound() const override { return bounds; }
+	bool Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const override;
+
+	static constexpr int maxVoxelsPerAxis = 128;
+
+	const Geometry* geometry;
+	std::vector<uint32_t> primitives;
+	Bbox bounds;
+	int nVoxels[3];
+	vec3 width, invWidth;
+	// objects of voxel v are voxelPrims[voxelStart[v] .. voxelStart[v + 1])
+	std::vector<uint32_t> voxelStart;
+	std::vector<uint32_t> voxelPrims;
+
+	int posToVoxel(const vec3& p, int axis) const
+	{
+		int v = (int)((p[axis] - bounds.pMin[axis]) * invWidth[axis]);
+		return std::max(0, std::min(nVoxels[axis] - 1, v));
+	}
+	float voxelToPos(int p, int axis) const { return bounds.pMin[axis] + p * width[axis]; }
+	int offset(int x, int y, int z) const { return z * nVoxels[0] * nVoxels[1] + y * nVoxels[0] + x; }
+};
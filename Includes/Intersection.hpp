@@ -7,5 +7,5 @@ public:
 	float hitDistance; // min t of the ray
 	vec3 WorldPosition; // WorldPosition of the hitPoint
 	vec3 WorldNormal; // WorldNormal of the hitPoint
-	Object* object; // hit object
+	const Material* material; // of the hit object
 };
\ No newline at end of file
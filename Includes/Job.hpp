@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include "Film.hpp"
+#include "CompiledScene.hpp"
+
+// options after the scene file, or after the scene files of a batch
+struct Options
+{
+	std::string compileTo, camerasFile;
+	bool cleanGeometry = false, quantizeVertices = false;
+	size_t memoryBudget = 0;
+	bool progressive = false;
+	bool costSchedule = true;
+	bool outputPerScene = false; // unnamed views are named after the scene file, for batches
+	int threads = 0; // of the thread pool, 0: one per hardware thread
+	Film::TileOrder tileOrder = Film::TileOrder::Scan;
+	Film::PixelOrder pixelOrder = Film::PixelOrder::Scan;
+	float timeBudget = 0.0f, previewInterval = 0.0f;
+	// --region x0 y0 x1 y1 or --tile i/N: only that part is rendered, each view to a
+	// partial framebuffer
+	bool partial = false;
+	Tile region = { 0, 0, 0, 0 };
+	int tileIndex = 0, tileCount = 0;
+	// checkpoint every view to <output>.checkpoint, and continue from it
+	float checkpointInterval = 0.0f;
+	bool resume = false;
+	int aaMaxSamples = 1;
+	float aaThreshold = 0.03f;
+	// accelerator settings of every scene
+	Accelerator::Type acceleratorType = Accelerator::Type::Auto;
+	bool optimizeBVH = false;
+	BVHAccel::NodeLayout bvhLayout = BVHAccel::NodeLayout::VanEmdeBoas;
+	BVHAccel::Traversal bvhTraversal = BVHAccel::Traversal::Stack;
+};
+
+// a loaded scene with everything its rendering reads, nothing of it is global
+struct Job
+{
+	std::string filename;
+	Geometry geometry;
+	std::vector<Light> lights;
+	CompiledScene compiled;
+	std::vector<View> views;
+	Scene scene = Scene(0, 0);
+
+	~Job() { delete scene.accelerator; }
+};
+
+void readOptions(int argc, char* argv[], int first, Options& options);
+// camera command values, eye:3 center:3 up:3 fovy:1
+View cameraView(const float* values);
+// parses or maps the scene file and builds its accelerator, one at a time: the
+// parser state is global
+std::unique_ptr<Job> loadJob(const char* filename, const Options& options);
+// the part of a w x h image rendered with --region or --tile, the image without them.
+// Tile i of N is the rows i * h / N up to (i + 1) * h / N
+Tile partRegion(const Options& options, int w, int h);
+// the partial framebuffer of a view, named after its output and region
+std::string partFilename(const std::string& output, const Tile& region);
+// the render options that are Film settings
+void applyOptions(Film& film, const Options& options);
+// every view to its output file, false when a stop was requested with checkpoints on
+bool renderJob(Job& job, const Options& options);
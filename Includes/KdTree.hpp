@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Accelerator.hpp"
+
+struct KdTreeNode;
+
+// SAH kd-tree after pbrt. Objects straddling a split plane are referenced from both
+// sides, so each ray keeps a small mailbox of recently tested objects to avoid
+// intersecting them twice.
+class KdTreeAccel : public Accelerator {
+public:
+	KdTreeAccel(const Geometry* geometry, std::vector<uint32_t> p, int isectCost = 80, int traversalCost = 1,
+		float emptyBonus = 0.5f, int maxPrims = 1, int maxDepth = -1);
+
+	const char* Name() const override { return "kd-tree"; }
+	Bbox WorldBound() const override { return bounds; }
+	bool Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const override;
+
+	const Geometry* geometry;
+	std::vector<uint32_t> primitives;
+	Bbox bounds;
+	std::vector<KdTreeNode> nodes; // below child follows its parent, above child is stored in the node
+	std::vector<uint32_t> primIndices; // objects of all leaves
+
+private:
+	struct BoundEdge;
+	const int isectCost, traversalCost, maxPrims;
+	const float emptyBonus;
+
+	void buildTree(const Bbox& nodeBounds, const std::vector<Bbox>& allPrimBounds, const std::vector<uint32_t>& primNums,
+		int depth, std::vector<BoundEdge> edges[3], int badRefines);
+};
+
+struct KdTreeNode
+{
+	union {
+		float split;         // interior
+		uint32_t primOffset; // leaf: first entry in primIndices
+	};
+	// low 2 bits: split axis, 3 for a leaf; upper 30 bits: above child or object count
+	uint32_t flags;
+
+	void initLeaf(uint32_t offset, uint32_t nPrims) { primOffset = offset; flags = 3 | (nPrims << 2); }
+	void initInterior(int axis, uint32_t aboveChild, float s) { split = s; flags = (uint32_t)axis | (aboveChild << 2); }
+
+	bool isLeaf() const { return (flags & 3) == 3; }
+	int splitAxis() const { return flags & 3; }
+	uint32_t nPrimitives() const { return flags >> 2; }
+	uint32_t aboveChild() const { return flags >> 2; }
+};
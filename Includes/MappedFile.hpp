@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+
+// View of a whole file through the virtual memory system, no copy into a buffer.
+// data() is not null terminated, parse up to end(). A copy-on-write view can be
+// written to, the changed pages become private and the file stays as it is.
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char* filename, bool copyOnWrite = false);
+	void close();
+
+	bool isOpen() const { return opened; }
+	const char* data() const { return (const char*)view; }
+	char* writableData() const { return (char*)view; } // copy-on-write views only
+	const char* end() const { return (const char*)view + length; }
+	size_t size() const { return length; }
+
+	// for out-of-core use: no read-ahead, and dropping pages from memory. Dropped pages
+	// are read again from the file, unless they were written (copy-on-write views)
+	void adviseRandom();
+	void discard(size_t offset, size_t size);
+
+private:
+	bool opened = false;
+	void* view = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
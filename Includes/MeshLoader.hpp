@@ -0,0 +1,10 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Utils.hpp"
+
+// Appends the vertex positions of an OBJ or binary PLY file to vertices and its
+// triangles to indices, as index triples into vertices. Faces with more than three
+// corners are split into fans, everything but positions and faces is skipped.
+// Returns false after printing the reason if the file cannot be read.
+bool loadMesh(const char* filename, std::vector<vec3>& vertices, std::vector<uint32_t>& indices);
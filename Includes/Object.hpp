@@ -2,10 +2,14 @@
 #include <iostream>
 #include <cmath>
 #include <random>
+#include <utility>
+#include <cstdint>
 #include "Bbox.hpp"
 
 enum shape { sphere, triangle };
 
+typedef std::pair<bool, float> PII;
+
 struct Material
 {
 	vec3 emission;
@@ -15,35 +19,74 @@ struct Material
 	float shininess;
 };
 
-class Object
+// Analytic sphere, an ellipsoid once transformed. transform indexes the tables of the
+// geometry, which also keeps the material of each sphere.
+class Sphere
 {
 public:
-	shape type;
 	vec3 centerPosition = vec3(0.0f);
-	float Radius;
-	mat4 transform;
+	float Radius = 0.0f;
+	uint32_t transform = 0;
 
-	int indices[3];
+	Bbox getObjectBbox(const mat4& transform) const;
+};
 
-	Material material;
-	Bbox getObjectBbox(vec3* Vertex);
+// Triangles sharing one material and transform. Their vertices are stored already
+// transformed to world space, the transform is kept as the mesh was placed.
+struct TriangleMesh
+{
+	uint32_t material;
+	uint32_t transform;
 };
 
-inline Bbox Object::getObjectBbox(vec3* Vertex)
+inline Bbox Sphere::getObjectBbox(const mat4& transform) const
+{
+	// half extent of the transformed sphere along each world axis is the radius
+	// times the length of that row of the linear part, also for rotated ellipsoids
+	vec3 Center = vec3(transform * vec4(centerPosition, 1.0f));
+	vec3 extent;
+	for (int i = 0; i < 3; i++)
+		extent[i] = Radius * sqrt(transform[0][i] * transform[0][i] + transform[1][i] * transform[1][i] + transform[2][i] * transform[2][i]);
+	return Bbox(Center - extent, Center + extent);
+}
+
+/*---------------------------------------------------------- Intersect ----------------------------------------------------------*/
+inline PII RaySphereIntersect(const Ray& ray, const Sphere* obj, const mat4& invTransf)
 {
-	if (type == triangle)
-	{
-		vec3 A = vec3(transform * vec4(Vertex[indices[0]], 1));
-		vec3 B = vec3(transform * vec4(Vertex[indices[1]], 1));
-		vec3 C = vec3(transform * vec4(Vertex[indices[2]], 1));
+	vec3 oriTransf = vec3(invTransf * vec4(ray.origin, 1.0f));
+	vec3 dirTransf = vec3(invTransf * vec4(ray.direction, 0.0f));
 
-		return Union(Bbox(A, B), C);
+	float a = glm::dot(dirTransf, dirTransf);
+	float b = 2 * glm::dot(dirTransf, (oriTransf - obj->centerPosition));
+	float c = glm::dot(oriTransf - obj->centerPosition, oriTransf - obj->centerPosition) - obj->Radius * obj->Radius;
+	float delta = b * b - 4 * a * c;
+	if (delta >= 0) {
+		float t1 = (-b + sqrt(delta)) / (2 * a);
+		float t2 = (-b - sqrt(delta)) / (2 * a);
+		float t = fmin(t1, t2);
+		if (0.00001 < t) return { true, t };
 	}
-	else
-	{
-		vec3 Center = vec3(transform * vec4(centerPosition, 1.0f));
-		float max_val = std::max(transform[0][0], std::max(transform[1][1], transform[2][2]));
-		return Bbox(vec3(Center.x - Radius * max_val, Center.y - Radius * max_val, Center.z - Radius * max_val),
-			vec3(Center.x + Radius * max_val, Center.y + Radius * max_val, Center.z + Radius * max_val));
+	return { false, -1.0f };
+}
+
+inline PII RayTriangleIntersect(const Ray& ray, const vec3& A, const vec3& B, const vec3& C)
+{
+	vec3 triNormal = glm::normalize(glm::cross(C - A, B - A));
+	float t = (glm::dot(A, triNormal) - glm::dot(ray.origin, triNormal)) / glm::dot(ray.direction, triNormal);
+	vec3 P = ray.origin + t * ray.direction;
+
+	// P in triangle? Barycentric Coord -- triangle area ratio, refer to ravi's lecture 16
+	// for beta
+	vec3 ACcrossAB = glm::cross(C - A, B - A);
+	vec3 ACcrossAP = glm::cross(C - A, P - A);
+	// for gamma
+	vec3 ABcrossAC = -ACcrossAB;
+	vec3 ABcrossAP = glm::cross(B - A, P - A);
+
+	if (glm::dot(ACcrossAB, ACcrossAP) >= 0 && glm::dot(ABcrossAC, ABcrossAP) >= 0) { // beta, gamma >= 0
+		float beta = glm::length(ACcrossAP) / glm::length(ACcrossAB);
+		float gamma = glm::length(ABcrossAP) / glm::length(ABcrossAC);
+		if (beta + gamma <= 1 && 0.00001 < t) return { true, t };
 	}
-}
\ No newline at end of file
+	return { false, -1.0f };
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include "MappedFile.hpp"
+
+// Keeps the resident part of a mapped file under a memory budget. The file is split
+// into chunks and the tracer stamps each chunk it reads with the current clock. A read
+// that takes the file over the budget drops another chunk right away: a hand sweeps the
+// chunks clearing their stamps, and the first resident one found without a stamp, not
+// read since the hand last passed, is handed back to the system. collect(), run between
+// batches of 4 tiles per thread, advances the clock. A dropped chunk is read from the
+// file again by its next access, so nothing is pinned and a ray never waits on another
+// thread. The budget can be exceeded by a chunk per thread.
+class PageCache
+{
+public:
+	static const int ChunkShift = 18; // 256 KB
+
+	PageCache(MappedFile& file, size_t budgetBytes);
+
+	void touch(const void* p)
+	{
+		size_t chunk = (size_t)((const char*)p - file.data()) >> ChunkShift;
+		uint32_t now = clock.load(std::memory_order_relaxed);
+		if (lastUse[chunk].load(std::memory_order_relaxed) == now) return;
+		lastUse[chunk].store(now, std::memory_order_relaxed);
+		if (!resident[chunk].exchange(true, std::memory_order_relaxed)) loaded(chunk);
+	}
+
+	// evict down to 3/4 of the budget if it is exceeded, then advance the clock
+	void collect();
+	void printStats() const;
+
+private:
+	void loaded(size_t chunk);
+
+	MappedFile& file;
+	size_t nChunks, budgetChunks;
+	std::unique_ptr<std::atomic<uint32_t>[]> lastUse;
+	std::unique_ptr<std::atomic<bool>[]> resident;
+	std::atomic<uint32_t> clock{ 1 };
+	std::atomic<size_t> residentChunks{ 0 };
+	std::atomic<size_t> hand{ 0 };
+	std::atomic<uint64_t> chunkLoads{ 0 };
+	std::atomic<uint64_t> evictions{ 0 };
+	std::atomic<size_t> peakChunks{ 0 };
+	std::mutex collecting;
+};
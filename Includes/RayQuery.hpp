@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include "Scene.hpp"
+
+// One ray of a batched query, 32 bytes, the record layout of the server's trace
+// request. Hits count from the origin in units of the direction, which need not be
+// normalized, and only those closer than tMax are reported.
+struct RayQuery
+{
+	static const uint32_t AnyHit = 1; // any hit below tMax will do, for visibility tests
+
+	float origin[3];
+	float direction[3];
+	float tMax;
+	uint32_t flags;
+};
+
+// 12 bytes, prim and material are Miss when nothing was hit. prim is the scene's
+// primitive id (triangles in the accelerator's leaf order, then the spheres),
+// material an index into its material table
+struct RayHit
+{
+	static const uint32_t Miss = 0xffffffffu;
+
+	float t;
+	uint32_t prim;
+	uint32_t material;
+};
+
+// Traces count rays on the thread pool, without shading. With a BVH the rays go down
+// the tree in packets of up to 32 of one direction octant, taken in their given
+// order, so coherent rays (neighbouring pixels, one light's shadow rays) share the
+// node fetches and box decoding, and tMax and AnyHit cut the traversal short. Any
+// other accelerator traces one ray at a time to its closest hit, and tMax is applied
+// to that afterwards: the results are the same, an any-hit ray gets its closest hit,
+// but neither flag saves work there.
+void traceRays(const Scene& scene, const RayQuery* rays, RayHit* hits, size_t count);
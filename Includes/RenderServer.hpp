@@ -0,0 +1,8 @@
+#pragma once
+#include "Job.hpp"
+
+// --serve: keeps loaded scenes with their accelerators resident and renders them on
+// request, from any camera, size and region, over a local socket (a Unix domain
+// socket, also on Windows 10 and later). One client and one request at a time, a
+// render has the whole thread pool. The requests are in HeliosHunter.md
+int serve(const char* socketPath, const Options& options);
@@ -2,22 +2,31 @@
 #include <vector>
 #include "Light.hpp"
 #include "BVH.hpp"
+#include "KdTree.hpp"
+#include "Grid.hpp"
 
 class Scene
 {
 public:
 	int w = 540;
 	int h = 540;
-	std::vector<Object*> Objects;
-	vec3* vertices;
-	Light* lights;
+	Geometry* geometry = nullptr;
+	Light* lights = nullptr;
+	int numLights = 0;
+	int maxDepth = 5;
+	vec3 attenuation = vec3(1, 0, 0);
 
 	Scene(int _w, int _h) : w(_w), h(_h) {}
 
-	void addObject(Object* obj);
-
-	BVHAccel* bvh;
-	void buildBVH();
+	Accelerator* accelerator = nullptr;
+	Accelerator::Type acceleratorType = Accelerator::Type::Auto;
+	bool optimizeBVH = false; // run the post-build optimization passes, worth it for scenes rendered many times
+	BVHAccel::NodeLayout bvhLayout = BVHAccel::NodeLayout::VanEmdeBoas;
+	BVHAccel::Traversal bvhTraversal = BVHAccel::Traversal::Stack;
+	void buildAccelerator();
+	std::vector<uint32_t> allPrimitives() const;
+	Accelerator::Type chooseAccelerator() const;
+	void reorderPrimitives(BVHAccel* bvh);
 };
 
 
@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// Fixed set of worker threads running one parallel loop at a time. The calling
+// thread works on the loop too, so a pool of one thread runs everything inline.
+// Loops of several threads take turns, except that a background thread runs its
+// loop inline while the pool is busy, so it never holds up the others.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int nThreads = 0); // 0: one per hardware thread
+	~ThreadPool();
+
+	int size() const { return (int)workers.size() + 1; }
+
+	// body(begin, end) over [0, count) in chunks of about grain indices
+	void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+	static ThreadPool& global();
+	// size of the global pool, before its first use; 0: one per hardware thread
+	static void setGlobalSize(int nThreads);
+	// marks the calling thread as a background one
+	static void setBackground(bool background);
+
+private:
+	void workerLoop();
+	void runChunks();
+
+	std::vector<std::thread> workers;
+	std::mutex running; // held by the thread whose loop the workers run
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	bool quit = false;
+	uint64_t generation = 0;
+	int busy = 0;
+
+	// current loop
+	const std::function<void(size_t, size_t)>* job = nullptr;
+	size_t jobCount = 0, jobGrain = 1;
+	std::atomic<size_t> nextIndex{ 0 };
+};
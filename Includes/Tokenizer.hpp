@@ -0,0 +1,68 @@
+#pragma once
+#include <charconv>
+#include <string_view>
+#include <cstring>
+
+// Walks the whitespace separated tokens of one line of text in place, without
+// copying the line or going through iostreams.
+struct Tokenizer
+{
+	const char* p;
+	const char* end;
+
+	Tokenizer(const char* begin, const char* end) : p(begin), end(end) {}
+
+	void skipSpace()
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	}
+
+	bool empty()
+	{
+		skipSpace();
+		return p == end;
+	}
+
+	// next token, empty at the end of the line
+	std::string_view word()
+	{
+		skipSpace();
+		const char* start = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+		return std::string_view(start, p - start);
+	}
+
+	bool readFloat(float& value)
+	{
+		skipSpace();
+		if (p < end && *p == '+') p++; // from_chars rejects the sign iostreams accept
+		std::from_chars_result r = std::from_chars(p, end, value);
+		if (r.ec != std::errc()) return false;
+		p = r.ptr;
+		return true;
+	}
+
+	bool readInt(long long& value)
+	{
+		skipSpace();
+		if (p < end && *p == '+') p++;
+		std::from_chars_result r = std::from_chars(p, end, value);
+		if (r.ec != std::errc()) return false;
+		p = r.ptr;
+		return true;
+	}
+
+	bool readvals(int numvals, float* values)
+	{
+		for (int i = 0; i < numvals; i++)
+			if (!readFloat(values[i])) return false;
+		return true;
+	}
+};
+
+// end of the line starting at p, the newline itself is not included
+inline const char* lineEnd(const char* p, const char* end)
+{
+	const void* nl = memchr(p, '\n', end - p);
+	return nl ? (const char*)nl : end;
+}
@@ -1,48 +1,113 @@
 #include <algorithm>
 #include <cassert>
+#include <iostream>
 #include "BVH.hpp"
 
-void quickSort(std::vector<Object*>& objects, int x, vec3* vertex, int l, int r)
+void quickSort(std::vector<uint32_t>& objects, int x, const std::vector<vec3>& centroids, int l, int r)
 {
     if (l >= r) return;
 
     int i = l - 1, j = r + 1;
     int mid = l + r >> 1;
-    Object* middle = objects[mid];
+    float middle = centroids[objects[mid]][x];
 
     while (i < j)
     {
-        if (x == 0)
-        {
-            do i++; while (objects[i]->getObjectBbox(vertex).Centroid().x < middle->getObjectBbox(vertex).Centroid().x);
-            do j--; while (objects[j]->getObjectBbox(vertex).Centroid().x > middle->getObjectBbox(vertex).Centroid().x);
-        }
-        else if (x == 1)
-        {
-            do i++; while (objects[i]->getObjectBbox(vertex).Centroid().y < middle->getObjectBbox(vertex).Centroid().y);
-            do j--; while (objects[j]->getObjectBbox(vertex).Centroid().y > middle->getObjectBbox(vertex).Centroid().y);
-        }
-        else
-        {
-            do i++; while (objects[i]->getObjectBbox(vertex).Centroid().z < middle->getObjectBbox(vertex).Centroid().z);
-            do j--; while (objects[j]->getObjectBbox(vertex).Centroid().z > middle->getObjectBbox(vertex).Centroid().z);
-        }
+        do i++; while (centroids[objects[i]][x] < middle);
+        do j--; while (centroids[objects[j]][x] > middle);
         if (i < j) std::swap(objects[i], objects[j]);
     }
 
-    quickSort(objects, x, vertex, l, j);
-    quickSort(objects, x, vertex, j + 1, r);
+    quickSort(objects, x, centroids, l, j);
+    quickSort(objects, x, centroids, j + 1, r);
+}
+
+// Store the bounds of both children in the frame of their parent box. The scale of
+// each axis is a power of two, so decoding is exact up to one rounding of the add,
+// which the outward adjustments below absorb.
+static void quantizeChildBounds(CompressedBVHNode& node, const Bbox& parent, const Bbox children[2])
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float lo = parent.pMin[a];
+        float extent = parent.pMax[a] - lo;
+        int e = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -100;
+        e = std::max(-100, std::min(100, e));
+        while (e < 100 && lo + 255 * std::ldexp(1.0f, e) < parent.pMax[a]) e++;
+
+        float scale = std::ldexp(1.0f, e);
+        node.origin[a] = lo;
+        node.exponent[a] = (int8_t)e;
+
+        for (int c = 0; c < 2; c++)
+        {
+            int qlo = (int)std::floor((children[c].pMin[a] - lo) / scale);
+            qlo = std::max(0, std::min(255, qlo));
+            while (qlo > 0 && lo + qlo * scale > children[c].pMin[a]) qlo--;
+
+            int qhi = (int)std::ceil((children[c].pMax[a] - lo) / scale);
+            qhi = std::max(0, std::min(255, qhi));
+            while (qhi < 255 && lo + qhi * scale < children[c].pMax[a]) qhi++;
+
+            node.qMin[c][a] = (uint8_t)qlo;
+            node.qMax[c][a] = (uint8_t)qhi;
+        }
+    }
 }
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, vec3* vertex)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(SplitMethod::Naive), primitives(std::move(p))
+BVHAccel::BVHAccel(const Geometry* geometry, std::vector<uint32_t> p, int maxPrimsInNode, bool optimize)
+    : root(nullptr), maxPrimsInNode(std::max(1, std::min((int)CompressedBVHNode::MaxLeafPrims, maxPrimsInNode))), geometry(geometry), primitives(std::move(p))
 {
     time_t start, stop;
     time(&start);
     if (primitives.empty())
         return;
+    // leaves address their primitives with the low bits of a child word
+    if (primitives.size() - 1 > CompressedBVHNode::PrimOffsetMask)
+    {
+        std::cerr << "Too Many Primitives for the BVH: " << primitives.size() << ", at most " << CompressedBVHNode::PrimOffsetMask + 1 << "\n";
+        throw 2;
+    }
+
+    // bounds and centroids by primitive id, the build sorts ids by them over and over
+    primBounds.resize(geometry->size());
+    primCentroids.resize(geometry->size());
+    for (uint32_t prim : primitives)
+    {
+        primBounds[prim] = geometry->bounds(prim);
+        primCentroids[prim] = primBounds[prim].Centroid();
+    }
+    root = recursiveBuild(primitives);
+    if (optimize && primitives.size() > 2)
+    {
+        optimizeBVHTree();
+        // reinsertion has no depth limit, the median split tree stays near log2 n
+        int depth = treeDepth(root);
+        if (depth > MaxDepth)
+        {
+            printf("Optimized BVH is %i levels deep, more than the traversal stack holds, using the base tree\n\n", depth);
+            deleteBVHTree(root);
+            root = recursiveBuild(primitives);
+        }
+    }
+    std::vector<Bbox>().swap(primBounds);
+    std::vector<vec3>().swap(primCentroids);
+    bounds = root->bounds;
 
-    root = recursiveBuild(primitives, vertex);
+    // flatten into the compressed layout, the pointer tree is only needed while building.
+    // A single primitive has no interior node and is tested against bounds directly.
+    if (primitives.size() > 1)
+    {
+        std::vector<uint32_t> orderedPrims;
+        orderedPrims.reserve(primitives.size());
+        nodes.reserve(primitives.size() - 1);
+        flattenBVHTree(root, orderedPrims);
+        primitives.swap(orderedPrims);
+        nodeArray = nodes.data();
+        nodeCount = (uint32_t)nodes.size();
+    }
+    deleteBVHTree(root);
+    root = nullptr;
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -51,11 +116,86 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod split
     int secs = (int)diff - (hrs * 3600) - (mins * 60);
 
     printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
+        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n",
         hrs, mins, secs);
+    printf("BVH Nodes: %zu (%zu KB)\n\n", nodes.size(), nodes.size() * sizeof(CompressedBVHNode) / 1024);
+}
+
+// Adopt an already flattened tree, e.g. the one stored in a compiled scene. The nodes
+// are used where they are and must outlive the BVH, p must be in leaf order.
+BVHAccel::BVHAccel(const Geometry* geometry, std::vector<uint32_t> p, const CompressedBVHNode* flatNodes, uint32_t nFlatNodes, const Bbox& worldBound)
+    : root(nullptr), maxPrimsInNode(1), geometry(geometry), primitives(std::move(p)),
+    bounds(worldBound), nodeArray(flatNodes), nodeCount(nFlatNodes)
+{
+}
+
+BVHAccel::~BVHAccel()
+{
+    deleteBVHTree(root);
+}
+
+void BVHAccel::deleteBVHTree(BVHBuildNode* node)
+{
+    if (node == nullptr) return;
+    deleteBVHTree(node->left);
+    deleteBVHTree(node->right);
+    delete node;
+}
+
+// leaves of the subtree, the count stops once it is past limit
+static size_t countLeaves(const BVHBuildNode* node, size_t limit)
+{
+    if (node->left == nullptr) return 1;
+    size_t n = countLeaves(node->left, limit);
+    return n > limit ? n : n + countLeaves(node->right, limit);
+}
+
+static void appendLeaves(const BVHBuildNode* node, std::vector<uint32_t>& orderedPrims)
+{
+    if (node->left == nullptr)
+    {
+        orderedPrims.push_back(node->prim);
+        return;
+    }
+    appendLeaves(node->left, orderedPrims);
+    appendLeaves(node->right, orderedPrims);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects, vec3* vertex)
+// Depth first: every interior node is written before its subtrees, and leaves
+// append their primitives to orderedPrims so each leaf owns a contiguous range.
+// A subtree of at most maxPrimsInNode primitives becomes a single leaf.
+uint32_t BVHAccel::flattenBVHTree(BVHBuildNode* node, std::vector<uint32_t>& orderedPrims)
+{
+    uint32_t offset = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    BVHBuildNode* children[2] = { node->left, node->right };
+    Bbox childBounds[2] = { node->left->bounds, node->right->bounds };
+    quantizeChildBounds(nodes[offset], node->bounds, childBounds);
+    nodes[offset].splitAxis = (uint8_t)node->splitAxis;
+
+    for (int c = 0; c < 2; c++)
+    {
+        BVHBuildNode* child = children[c];
+        if (countLeaves(child, (size_t)maxPrimsInNode) <= (size_t)maxPrimsInNode)
+        {
+            child->firstPrimOffset = (int)orderedPrims.size();
+            appendLeaves(child, orderedPrims);
+            child->nPrimitive = (int)orderedPrims.size() - child->firstPrimOffset;
+            nodes[offset].child[c] = CompressedBVHNode::LeafFlag
+                | ((uint32_t)(child->nPrimitive - 1) << CompressedBVHNode::LeafCountShift)
+                | (uint32_t)child->firstPrimOffset;
+        }
+        else
+        {
+            uint32_t childOffset = flattenBVHTree(child, orderedPrims);
+            nodes[offset].child[c] = childOffset;
+        }
+    }
+    return offset;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<uint32_t> objects)
 {
     BVHBuildNode* node = new BVHBuildNode();
 
@@ -63,43 +203,219 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects, vec3* verte
     if (objects.size() == 1)
     {
         //leafNode created
-        node->bounds = objects[0]->getObjectBbox(vertex);
-        node->object = objects[0];
+        node->bounds = primBounds[objects[0]];
+        node->prim = objects[0];
         node->left = nullptr;
         node->right = nullptr;
         return node;
     }
     else if (objects.size() == 2)
     {
-        node->left = recursiveBuild(std::vector<Object*>{ objects[0] }, vertex);
-        node->right = recursiveBuild(std::vector<Object*>{ objects[1] }, vertex);
+        node->left = recursiveBuild(std::vector<uint32_t>{ objects[0] });
+        node->right = recursiveBuild(std::vector<uint32_t>{ objects[1] });
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
+        node->splitAxis = Union(Bbox(node->left->bounds.Centroid()), node->right->bounds.Centroid()).maxExtent();
         return node;
     }
     else
     {
-        Bbox centroidBounds;
-        for (int i = 0; i < objects.size(); i++)
+        Bbox centroidBounds(primCentroids[objects[0]]);
+        for (int i = 1; i < objects.size(); i++)
             centroidBounds =
-            Union(centroidBounds, objects[i]->getObjectBbox(vertex).Centroid());
+            Union(centroidBounds, primCentroids[objects[i]]);
         int dim = centroidBounds.maxExtent(), size = objects.size() - 1;
-        quickSort(objects, dim, vertex, 0, size);
+        quickSort(objects, dim, primCentroids, 0, size);
+        node->splitAxis = dim;
 
         auto beginning = objects.begin();
         auto middling = objects.begin() + (objects.size() / 2);
         auto ending = objects.end();
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+        auto leftshapes = std::vector<uint32_t>(beginning, middling);
+        auto rightshapes = std::vector<uint32_t>(middling, ending);
 
         assert(objects.size() == (leftshapes.size() + rightshapes.size()));
 
-        node->left = recursiveBuild(leftshapes, vertex);
-        node->right = recursiveBuild(rightshapes, vertex);
+        node->left = recursiveBuild(leftshapes);
+        node->right = recursiveBuild(rightshapes);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
     }
 
     return node;
-}
\ No newline at end of file
+}
+
+int BVHAccel::flatTreeDepth(const CompressedBVHNode* nodes, uint32_t nNodes, uint32_t nPrims)
+{
+    if (nNodes == 0) return 0;
+    std::vector<bool> reached(nNodes, false);
+    std::vector<std::pair<uint32_t, int>> toVisit{ { 0, 1 } };
+    reached[0] = true;
+    int depth = 0;
+    while (!toVisit.empty())
+    {
+        std::pair<uint32_t, int> entry = toVisit.back();
+        toVisit.pop_back();
+        depth = std::max(depth, entry.second);
+        const CompressedBVHNode& node = nodes[entry.first];
+        for (int c = 0; c < 2; c++)
+        {
+            if (node.isLeaf(c))
+            {
+                if ((uint64_t)node.leafPrimOffset(c) + node.leafPrimCount(c) > nPrims) return -1;
+                continue;
+            }
+            uint32_t child = node.child[c];
+            if (child >= nNodes || reached[child]) return -1;
+            reached[child] = true;
+            toVisit.push_back({ child, entry.second + 1 });
+        }
+    }
+    return depth;
+}
+
+/*---------------------------------------------------------- Traversal ----------------------------------------------------------*/
+void BVHAccel::setTraversal(Traversal mode)
+{
+    traversal = mode;
+    if (traversal == Traversal::Stackless && parents.size() != nodeCount)
+        buildParentLinks();
+}
+
+static inline void intersectLeaf(const BVHAccel* bvh, uint32_t first, uint32_t count, const Ray& ray,
+    float& hitDistance, uint32_t& hitPrim)
+{
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        PII hit = bvh->geometry->intersect(ray, bvh->primitives[i]);
+        if (hit.first && hit.second < hitDistance)
+        {
+            hitDistance = hit.second;
+            hitPrim = bvh->primitives[i];
+        }
+    }
+}
+
+bool BVHAccel::Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const
+{
+    hitDistance = std::numeric_limits<float>::max();
+
+    float x = 0, y = 0, z = 0;
+    if (ray.direction.x != 0.0f) x = 1.0f / ray.direction.x;
+    if (ray.direction.y != 0.0f) y = 1.0f / ray.direction.y;
+    if (ray.direction.z != 0.0f) z = 1.0f / ray.direction.z;
+    vec3 invDir(x, y, z);
+
+    std::array<int, 3> dirIsNeg;
+    dirIsNeg[0] = ray.direction.x > 0 ? 0 : 1;
+    dirIsNeg[1] = ray.direction.y > 0 ? 0 : 1;
+    dirIsNeg[2] = ray.direction.z > 0 ? 0 : 1;
+
+    if (primitives.empty() || !bounds.IntersectionP(ray, invDir, dirIsNeg))
+        return false;
+
+    if (nodeCount == 0)
+        intersectLeaf(this, 0, (uint32_t)primitives.size(), ray, hitDistance, hitPrim);
+    else if (traversal == Traversal::Stackless)
+        intersectStackless(ray, invDir, dirIsNeg, hitDistance, hitPrim);
+    else
+        intersectStack(ray, invDir, dirIsNeg, hitDistance, hitPrim);
+    return hitDistance < std::numeric_limits<float>::max();
+}
+
+// near child first, far child pushed; boxes behind the closest hit are skipped
+void BVHAccel::intersectStack(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirIsNeg,
+    float& hitDistance, uint32_t& hitPrim) const
+{
+    uint32_t toVisit[MaxDepth];
+    int toVisitOffset = 0;
+    uint32_t current = 0;
+    while (true)
+    {
+        const CompressedBVHNode& node = nodeArray[current];
+        if (geometry->pageCache != nullptr) geometry->pageCache->touch(&node);
+        int first = dirIsNeg[node.splitAxis];
+        bool hit[2];
+        for (int c = 0; c < 2; c++)
+            hit[c] = node.childBounds(c).IntersectionP(ray, invDir, dirIsNeg, hitDistance);
+
+        int next = -1;
+        for (int k = 0; k < 2; k++)
+        {
+            int c = k == 0 ? first : 1 - first;
+            if (!hit[c]) continue;
+            if (node.isLeaf(c))
+                intersectLeaf(this, node.leafPrimOffset(c), node.leafPrimCount(c), ray, hitDistance, hitPrim);
+            else if (next < 0)
+                next = (int)node.child[c];
+            else
+                toVisit[toVisitOffset++] = node.child[c];
+        }
+
+        if (next >= 0)
+            current = (uint32_t)next;
+        else if (toVisitOffset > 0)
+            current = toVisit[--toVisitOffset];
+        else
+            break;
+    }
+}
+
+// Same visiting order without a stack, walking back up through the parent links
+// (Hapala et al. 2011). The current position is child `slot` of interior `current`,
+// and state records how it was reached.
+void BVHAccel::intersectStackless(const Ray& ray, const vec3& invDir, const std::array<int, 3>& dirIsNeg,
+    float& hitDistance, uint32_t& hitPrim) const
+{
+    enum { FromParent, FromSibling, FromChild } state = FromParent;
+    uint32_t current = 0;
+    int slot = dirIsNeg[nodeArray[0].splitAxis];
+    while (true)
+    {
+        const CompressedBVHNode& node = nodeArray[current];
+        if (geometry->pageCache != nullptr) geometry->pageCache->touch(&node);
+        int nearSlot = dirIsNeg[node.splitAxis];
+        if (state == FromChild)
+        {
+            if (slot == nearSlot)
+            {
+                slot = 1 - slot;
+                state = FromSibling;
+            }
+            else
+            {
+                if (current == 0) return;
+                uint32_t link = parents[current];
+                current = link >> 1;
+                slot = link & 1;
+                continue;
+            }
+        }
+
+        bool hit = node.childBounds(slot).IntersectionP(ray, invDir, dirIsNeg, hitDistance);
+        if (hit && !node.isLeaf(slot))
+        {
+            current = node.child[slot];
+            slot = dirIsNeg[nodeArray[current].splitAxis];
+            state = FromParent;
+            continue;
+        }
+        if (hit)
+            intersectLeaf(this, node.leafPrimOffset(slot), node.leafPrimCount(slot), ray, hitDistance, hitPrim);
+
+        if (state == FromParent)
+        {
+            slot = 1 - slot;
+            state = FromSibling;
+        }
+        else
+        {
+            if (current == 0) return;
+            uint32_t link = parents[current];
+            current = link >> 1;
+            slot = link & 1;
+            state = FromChild;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#include <algorithm>
+#include "BVH.hpp"
+
+static int subtreeHeight(const std::vector<CompressedBVHNode>& nodes, uint32_t node)
+{
+    int height = 0;
+    for (int c = 0; c < 2; c++)
+        if (!nodes[node].isLeaf(c))
+            height = std::max(height, subtreeHeight(nodes, nodes[node].child[c]));
+    return height + 1;
+}
+
+// Lay out the top `levels` levels below node recursively: the upper half of the
+// levels first, then every subtree hanging below it. The roots of the subtrees
+// below the last level are handed back in frontier.
+static void layoutVanEmdeBoas(const std::vector<CompressedBVHNode>& nodes, uint32_t node, int levels,
+    std::vector<uint32_t>& order, std::vector<uint32_t>& frontier)
+{
+    if (levels == 1)
+    {
+        order.push_back(node);
+        for (int c = 0; c < 2; c++)
+            if (!nodes[node].isLeaf(c))
+                frontier.push_back(nodes[node].child[c]);
+        return;
+    }
+
+    int topLevels = levels / 2;
+    std::vector<uint32_t> bottomRoots;
+    layoutVanEmdeBoas(nodes, node, topLevels, order, bottomRoots);
+    for (uint32_t bottom : bottomRoots)
+        layoutVanEmdeBoas(nodes, bottom, levels - topLevels, order, frontier);
+}
+
+// Depth first keeps a node next to its first child only, the van Emde Boas order
+// packs every subtree of 2^k levels into one contiguous block at every scale k,
+// so a root to leaf path touches O(log_B n) blocks whatever the cache line size B.
+void BVHAccel::reorderNodes(NodeLayout layout)
+{
+    if (layout == NodeLayout::DepthFirst || nodes.size() < 3)
+        return;
+
+    std::vector<uint32_t> order, frontier;
+    order.reserve(nodes.size());
+    layoutVanEmdeBoas(nodes, 0, subtreeHeight(nodes, 0), order, frontier);
+
+    std::vector<uint32_t> newIndex(nodes.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        newIndex[order[i]] = i;
+
+    std::vector<CompressedBVHNode> reordered(nodes.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+    {
+        reordered[i] = nodes[order[i]];
+        for (int c = 0; c < 2; c++)
+            if (!reordered[i].isLeaf(c))
+                reordered[i].child[c] = newIndex[reordered[i].child[c]];
+    }
+    nodes.swap(reordered);
+    nodeArray = nodes.data();
+}
+
+void BVHAccel::buildParentLinks()
+{
+    parents.assign(nodeCount, 0);
+    for (uint32_t i = 0; i < nodeCount; i++)
+        for (int c = 0; c < 2; c++)
+            if (!nodeArray[i].isLeaf(c))
+                parents[nodeArray[i].child[c]] = i << 1 | (uint32_t)c;
+}
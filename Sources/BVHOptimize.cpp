@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <queue>
+#include <chrono>
+#include "BVH.hpp"
+
+// SAH weights of a box test and a primitive test
+const float traversalCost = 1.2f;
+const float intersectCost = 1.0f;
+
+// treelets are limited to 7 leaves, 2^7 subsets keep the search cheap enough
+const int maxTreeletSize = 7;
+
+static bool isLeaf(const BVHBuildNode* node)
+{
+    return node->left == nullptr && node->right == nullptr;
+}
+
+// recompute bounds, cost and split axis of an interior node from its children
+static void refitNode(BVHBuildNode* node)
+{
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->cost = traversalCost * node->bounds.SurfaceArea() + node->left->cost + node->right->cost;
+
+    vec3 d = glm::abs(node->right->bounds.Centroid() - node->left->bounds.Centroid());
+    node->splitAxis = (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z ? 1 : 2);
+}
+
+static void refitUpwards(BVHBuildNode* node)
+{
+    for (; node != nullptr; node = node->parent)
+        refitNode(node);
+}
+
+static void replaceChild(BVHBuildNode* parent, BVHBuildNode* oldChild, BVHBuildNode* newChild)
+{
+    if (parent->left == oldChild) parent->left = newChild;
+    else parent->right = newChild;
+    newChild->parent = parent;
+}
+
+float BVHAccel::computeSAHCost(BVHBuildNode* node)
+{
+    if (isLeaf(node))
+    {
+        node->cost = intersectCost * node->bounds.SurfaceArea();
+        return node->cost;
+    }
+    node->left->parent = node;
+    node->right->parent = node;
+    computeSAHCost(node->left);
+    computeSAHCost(node->right);
+    node->cost = traversalCost * node->bounds.SurfaceArea() + node->left->cost + node->right->cost;
+    return node->cost;
+}
+
+// interior levels, without recursion: reinsertion can leave long chains
+int BVHAccel::treeDepth(const BVHBuildNode* node)
+{
+    int depth = 0;
+    std::vector<std::pair<const BVHBuildNode*, int>> toVisit{ { node, 0 } };
+    while (!toVisit.empty())
+    {
+        std::pair<const BVHBuildNode*, int> entry = toVisit.back();
+        toVisit.pop_back();
+        if (entry.first->left == nullptr) continue;
+        depth = std::max(depth, entry.second + 1);
+        toVisit.push_back({ entry.first->left, entry.second + 1 });
+        toVisit.push_back({ entry.first->right, entry.second + 1 });
+    }
+    return depth;
+}
+
+/*---------------------------------------------------------- Reinsertion ----------------------------------------------------------*/
+// Branch and bound search for the sibling that adds the least surface area to the
+// tree, counting the growth of every ancestor on the way down (Bittner et al. 2013).
+static BVHBuildNode* findBestSibling(BVHBuildNode* root, const Bbox& box)
+{
+    typedef std::pair<float, BVHBuildNode*> Candidate; // induced cost, node
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+    queue.push(Candidate(0.0f, root));
+
+    float boxArea = box.SurfaceArea();
+    float bestCost = std::numeric_limits<float>::max();
+    BVHBuildNode* best = root;
+    while (!queue.empty())
+    {
+        float induced = queue.top().first;
+        BVHBuildNode* node = queue.top().second;
+        queue.pop();
+        if (induced + boxArea >= bestCost) break;
+
+        float cost = induced + Union(node->bounds, box).SurfaceArea();
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            best = node;
+        }
+        if (!isLeaf(node))
+        {
+            float childInduced = cost - node->bounds.SurfaceArea();
+            if (childInduced + boxArea < bestCost)
+            {
+                queue.push(Candidate(childInduced, node->left));
+                queue.push(Candidate(childInduced, node->right));
+            }
+        }
+    }
+    return best;
+}
+
+// hang node next to its best sibling, using spare as the new interior node
+static void insertNode(BVHBuildNode*& root, BVHBuildNode* node, BVHBuildNode* spare)
+{
+    BVHBuildNode* sibling = findBestSibling(root, node->bounds);
+    BVHBuildNode* parent = sibling->parent;
+
+    spare->left = sibling;
+    spare->right = node;
+    sibling->parent = spare;
+    node->parent = spare;
+    spare->parent = nullptr;
+    if (parent == nullptr) root = spare;
+    else replaceChild(parent, sibling, spare);
+    refitUpwards(spare);
+}
+
+// Take out the interior nodes that waste the most area (large box, small children),
+// and reinsert both of their children at the best place in the whole tree.
+void BVHAccel::reinsertNodes(float fraction)
+{
+    std::vector<std::pair<float, BVHBuildNode*>> candidates;
+    std::vector<BVHBuildNode*> toVisit{ root };
+    while (!toVisit.empty())
+    {
+        BVHBuildNode* node = toVisit.back();
+        toVisit.pop_back();
+        if (isLeaf(node)) continue;
+        toVisit.push_back(node->left);
+        toVisit.push_back(node->right);
+        if (node->parent == nullptr || node->parent->parent == nullptr) continue;
+
+        float area = node->bounds.SurfaceArea();
+        float leftArea = node->left->bounds.SurfaceArea(), rightArea = node->right->bounds.SurfaceArea();
+        float minArea = std::max(std::min(leftArea, rightArea), 1e-12f);
+        float sumArea = std::max(leftArea + rightArea, 1e-12f);
+        candidates.push_back({ area * (2.0f * area / sumArea) * (area / minArea), node });
+    }
+    if (candidates.empty()) return;
+
+    size_t count = std::max<size_t>(1, (size_t)(fraction * candidates.size()));
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+        [](const std::pair<float, BVHBuildNode*>& a, const std::pair<float, BVHBuildNode*>& b) { return a.first > b.first; });
+
+    for (size_t i = 0; i < count; i++)
+    {
+        BVHBuildNode* node = candidates[i].second;
+        BVHBuildNode* parent = node->parent;
+        if (parent == nullptr || parent->parent == nullptr) continue; // moved up by an earlier reinsertion
+
+        // the sibling takes the place of the parent, freeing node and parent
+        BVHBuildNode* sibling = parent->left == node ? parent->right : parent->left;
+        BVHBuildNode* grandparent = parent->parent;
+        replaceChild(grandparent, parent, sibling);
+        refitUpwards(grandparent);
+
+        BVHBuildNode* left = node->left;
+        BVHBuildNode* right = node->right;
+        insertNode(root, left, node);
+        insertNode(root, right, parent);
+    }
+}
+
+/*---------------------------------------------------------- Treelets ----------------------------------------------------------*/
+static void rebuildTreelet(BVHBuildNode* node, int subset, BVHBuildNode** leaves, BVHBuildNode** interiors,
+    int& nextInterior, const int* optSplit)
+{
+    int parts[2] = { optSplit[subset], subset ^ optSplit[subset] };
+    BVHBuildNode* children[2];
+    for (int c = 0; c < 2; c++)
+    {
+        if ((parts[c] & (parts[c] - 1)) == 0)
+        {
+            int leaf = 0;
+            while ((parts[c] >> leaf) != 1) leaf++;
+            children[c] = leaves[leaf];
+        }
+        else
+        {
+            children[c] = interiors[nextInterior++];
+            rebuildTreelet(children[c], parts[c], leaves, interiors, nextInterior, optSplit);
+        }
+    }
+    node->left = children[0];
+    node->right = children[1];
+    node->left->parent = node;
+    node->right->parent = node;
+    refitNode(node);
+}
+
+// Bottom up, grow a treelet of up to maxTreeletLeaves below each node and replace it
+// with the topology of least SAH cost over its leaves (Karras & Aila 2013).
+void BVHAccel::restructureTreelets(BVHBuildNode* node, int maxTreeletLeaves)
+{
+    if (isLeaf(node)) return;
+    restructureTreelets(node->left, maxTreeletLeaves);
+    restructureTreelets(node->right, maxTreeletLeaves);
+    // a rebuilt subtree changes the bounds and cost of the nodes above it
+    refitNode(node);
+
+    // expand the treelet leaf with the largest surface area until the treelet is full
+    maxTreeletLeaves = std::min(maxTreeletLeaves, maxTreeletSize);
+    BVHBuildNode* leaves[maxTreeletSize] = { node->left, node->right };
+    BVHBuildNode* interiors[maxTreeletSize - 1] = { node };
+    int nLeaves = 2, nInteriors = 1;
+    while (nLeaves < maxTreeletLeaves)
+    {
+        int expand = -1;
+        float expandArea = -1.0f;
+        for (int i = 0; i < nLeaves; i++)
+        {
+            if (!isLeaf(leaves[i]) && leaves[i]->bounds.SurfaceArea() > expandArea)
+            {
+                expand = i;
+                expandArea = leaves[i]->bounds.SurfaceArea();
+            }
+        }
+        if (expand < 0) break;
+
+        BVHBuildNode* expanded = leaves[expand];
+        interiors[nInteriors++] = expanded;
+        leaves[expand] = expanded->left;
+        leaves[nLeaves++] = expanded->right;
+    }
+    if (nLeaves < 3) return;
+    // expanded top down, refit bottom up, node last
+    for (int i = nInteriors - 1; i >= 0; i--)
+        refitNode(interiors[i]);
+
+    // every proper subset of s is smaller than s, so increasing order is a valid DP order
+    const int nSubsets = 1 << nLeaves;
+    float area[1 << maxTreeletSize], optCost[1 << maxTreeletSize];
+    int optSplit[1 << maxTreeletSize];
+    for (int s = 1; s < nSubsets; s++)
+    {
+        int first = 0;
+        while (((s >> first) & 1) == 0) first++;
+        Bbox b = leaves[first]->bounds;
+        for (int i = first + 1; i < nLeaves; i++)
+            if ((s >> i) & 1) b = Union(b, leaves[i]->bounds);
+        area[s] = b.SurfaceArea();
+
+        if ((s & (s - 1)) == 0)
+        {
+            optCost[s] = leaves[first]->cost;
+            continue;
+        }
+        float best = std::numeric_limits<float>::max();
+        int split = 0;
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+        {
+            float cost = optCost[p] + optCost[s ^ p];
+            if (cost < best)
+            {
+                best = cost;
+                split = p;
+            }
+        }
+        optCost[s] = traversalCost * area[s] + best;
+        optSplit[s] = split;
+    }
+
+    // keep the treelet unless the gain is more than rounding noise
+    if (optCost[nSubsets - 1] >= node->cost * (1.0f - 1e-5f)) return;
+    int nextInterior = 1;
+    rebuildTreelet(node, nSubsets - 1, leaves, interiors, nextInterior, optSplit);
+}
+
+void BVHAccel::optimizeBVHTree()
+{
+    printf("-----Optimizing BVH...\n\n");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    computeSAHCost(root);
+    float rootArea = root->bounds.SurfaceArea();
+    printf("SAH Cost: %.3f (base builder)\n", root->cost / rootArea);
+
+    for (int pass = 0; pass < 2; pass++)
+        reinsertNodes(0.01f);
+    printf("SAH Cost: %.3f (after reinsertion)\n", root->cost / rootArea);
+
+    for (int pass = 0; pass < 3; pass++)
+        restructureTreelets(root, maxTreeletSize);
+    printf("SAH Cost: %.3f (after treelet restructuring)\n", root->cost / rootArea);
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("BVH Optimization Time: %lld ms\n\n",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+}
@@ -0,0 +1,311 @@
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <algorithm>
+#include "CompiledScene.hpp"
+#include "ThreadPool.hpp"
+
+extern int width, height, maxDepth;
+extern std::vector<View> views;
+extern vec3 attenuation;
+extern int numVertices, numObjects, numLights;
+
+static_assert(sizeof(vec3) == 12 && sizeof(mat4) == 64, "glm types are stored as raw floats");
+static_assert(sizeof(Material) == 13 * sizeof(float), "Material is stored as raw floats");
+static_assert(sizeof(CompressedBVHNode) == 36, "BVH nodes are stored as they are");
+
+const size_t sectionAlignment = 64;
+
+static bool sectionFits(uint64_t offset, uint64_t count, size_t elementSize, size_t fileSize)
+{
+    return offset % 4 == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
+
+bool CompiledScene::open(const char* filename)
+{
+    // copy-on-write, rebuilding the BVH reorders the vertices in place
+    if (!file.open(filename, true) || file.size() < sizeof(CompiledSceneHeader) || memcmp(file.data(), "HHSCENE", 8) != 0)
+    {
+        file.close();
+        return false;
+    }
+    const CompiledSceneHeader* h = (const CompiledSceneHeader*)file.data();
+    if (h->version != CompiledSceneHeader::Version)
+    {
+        std::cerr << "Compiled Scene " << filename << " has Version " << h->version << ", expected "
+            << CompiledSceneHeader::Version << ". Compile it again\n";
+        throw 2;
+    }
+    if (!sectionFits(h->viewOffset, h->nViews, sizeof(CompiledSceneView), file.size())
+        || !sectionFits(h->vertexOffset, h->nVertices, sizeof(vec3), file.size())
+        || !sectionFits(h->indexOffset, 3ull * h->nTriangles, sizeof(uint32_t), file.size())
+        || !sectionFits(h->triangleMeshOffset, h->nTriangles, sizeof(uint32_t), file.size())
+        || !sectionFits(h->meshOffset, h->nMeshes, sizeof(CompiledSceneMesh), file.size())
+        || !sectionFits(h->sphereOffset, h->nSpheres, sizeof(CompiledSceneSphere), file.size())
+        || !sectionFits(h->materialOffset, h->nMaterials, sizeof(Material), file.size())
+        || !sectionFits(h->transformOffset, h->nTransforms, sizeof(mat4), file.size())
+        || !sectionFits(h->lightOffset, h->nLights, sizeof(CompiledSceneLight), file.size())
+        || !sectionFits(h->bvhOffset, h->nBVHNodes, sizeof(CompressedBVHNode), file.size())
+        || !sectionFits(h->bvhPrimitiveOffset, h->nBVHPrimitives, sizeof(uint32_t), file.size()))
+    {
+        std::cerr << "Compiled Scene " << filename << " is Truncated or Corrupt\n";
+        throw 2;
+    }
+    header = h;
+    return true;
+}
+
+void CompiledScene::load(Geometry& geometry, std::vector<Light>& lights)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    const CompiledSceneHeader& h = *header;
+    width = h.width;
+    height = h.height;
+    maxDepth = h.maxDepth;
+    const CompiledSceneView* fileViews = (const CompiledSceneView*)(file.data() + h.viewOffset);
+    views.resize(h.nViews);
+    for (uint32_t i = 0; i < h.nViews; i++)
+    {
+        const CompiledSceneView& in = fileViews[i];
+        views[i].eye = vec3(in.eye[0], in.eye[1], in.eye[2]);
+        views[i].center = vec3(in.center[0], in.center[1], in.center[2]);
+        views[i].up = vec3(in.up[0], in.up[1], in.up[2]);
+        views[i].fovy = in.fovy;
+        views[i].output = std::string(in.output, strnlen(in.output, sizeof(in.output)));
+    }
+    attenuation = vec3(h.attenuation[0], h.attenuation[1], h.attenuation[2]);
+
+    const CompiledSceneLight* fileLights = (const CompiledSceneLight*)(file.data() + h.lightOffset);
+    lights.resize(h.nLights);
+    for (uint32_t i = 0; i < h.nLights; i++)
+    {
+        lights[i].lightColor = vec3(fileLights[i].color[0], fileLights[i].color[1], fileLights[i].color[2]);
+        lights[i].lightPosition = vec4(fileLights[i].position[0], fileLights[i].position[1], fileLights[i].position[2], fileLights[i].position[3]);
+    }
+
+    // ids of the file's tables in those of the geometry
+    const Material* materials = (const Material*)(file.data() + h.materialOffset);
+    const mat4* transforms = (const mat4*)(file.data() + h.transformOffset);
+    std::vector<uint32_t> materialIds(h.nMaterials), transformIds(h.nTransforms);
+    for (uint32_t i = 0; i < h.nMaterials; i++)
+        materialIds[i] = geometry.addMaterial(materials[i]);
+    for (uint32_t i = 0; i < h.nTransforms; i++)
+        transformIds[i] = geometry.addTransform(transforms[i]);
+
+    bool valid = true;
+    const CompiledSceneMesh* fileMeshes = (const CompiledSceneMesh*)(file.data() + h.meshOffset);
+    geometry.meshes.resize(h.nMeshes);
+    for (uint32_t i = 0; i < h.nMeshes; i++)
+    {
+        if (fileMeshes[i].material >= h.nMaterials || fileMeshes[i].transform >= h.nTransforms) { valid = false; break; }
+        geometry.meshes[i].material = materialIds[fileMeshes[i].material];
+        geometry.meshes[i].transform = transformIds[fileMeshes[i].transform];
+    }
+    const CompiledSceneSphere* fileSpheres = (const CompiledSceneSphere*)(file.data() + h.sphereOffset);
+    geometry.spheres.resize(h.nSpheres);
+    geometry.sphereMaterial.resize(h.nSpheres);
+    for (uint32_t i = 0; i < h.nSpheres && valid; i++)
+    {
+        const CompiledSceneSphere& in = fileSpheres[i];
+        if (in.material >= h.nMaterials || in.transform >= h.nTransforms) { valid = false; break; }
+        Sphere& obj = geometry.spheres[i];
+        geometry.sphereMaterial[i] = materialIds[in.material];
+        obj.transform = transformIds[in.transform];
+        obj.centerPosition = vec3(in.sphere[0], in.sphere[1], in.sphere[2]);
+        obj.Radius = in.sphere[3];
+    }
+
+    // the triangle buffers are used in place, writes to them stay in memory
+    geometry.vertices = (vec3*)(file.writableData() + h.vertexOffset);
+    geometry.indices = (uint32_t*)(file.writableData() + h.indexOffset);
+    geometry.triangleMesh = (uint32_t*)(file.writableData() + h.triangleMeshOffset);
+    geometry.numVertices = h.nVertices;
+    geometry.numTriangles = h.nTriangles;
+    std::atomic<bool> inRange(true);
+    ThreadPool::global().parallelFor(h.nTriangles, 4096, [&](size_t begin, size_t end) {
+        bool ok = true;
+        for (size_t t = begin; t < end; t++)
+        {
+            ok = ok && geometry.triangleMesh[t] < h.nMeshes;
+            for (int k = 0; k < 3; k++)
+                ok = ok && geometry.indices[3 * t + k] < h.nVertices;
+        }
+        if (!ok) inRange = false;
+    });
+    if (!valid || !inRange)
+    {
+        std::cerr << "Compiled Scene has Out of Range Indices\n";
+        throw 2;
+    }
+    numVertices = (int)h.nVertices;
+    numObjects = (int)geometry.size();
+    numLights = (int)h.nLights;
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("Compiled Scene Loading Time: %lld ms\n\n", (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+}
+
+BVHAccel* CompiledScene::createBVH(const Geometry* geometry) const
+{
+    const uint32_t* filePrims = (const uint32_t*)(file.data() + header->bvhPrimitiveOffset);
+    std::vector<uint32_t> prims(filePrims, filePrims + header->nBVHPrimitives);
+    for (uint32_t prim : prims)
+    {
+        if (prim >= geometry->size())
+        {
+            std::cerr << "Compiled Scene has a Corrupt BVH\n";
+            throw 2;
+        }
+    }
+    // a tree in range that the traversal stack holds, nothing else is traversed safely
+    const CompressedBVHNode* nodes = (const CompressedBVHNode*)(file.data() + header->bvhOffset);
+    int depth = BVHAccel::flatTreeDepth(nodes, header->nBVHNodes, (uint32_t)prims.size());
+    if (depth < 0 || depth > BVHAccel::MaxDepth)
+    {
+        std::cerr << "Compiled Scene has a Corrupt BVH\n";
+        throw 2;
+    }
+    const float* b = header->bvhBounds;
+    printf("-----Using the BVH of the compiled scene (%u nodes)\n\n", header->nBVHNodes);
+    return new BVHAccel(geometry, std::move(prims), nodes, header->nBVHNodes, Bbox(vec3(b[0], b[1], b[2]), vec3(b[3], b[4], b[5])));
+}
+
+void CompiledScene::streamGeometry(Geometry& geometry, size_t budgetBytes)
+{
+    pageCache.reset(new PageCache(file, budgetBytes));
+    geometry.pageCache = pageCache.get();
+}
+
+/*---------------------------------------------------------- Writing ----------------------------------------------------------*/
+template <typename T>
+static uint64_t writeSection(std::ofstream& out, const std::vector<T>& data)
+{
+    uint64_t offset = (uint64_t)out.tellp();
+    uint64_t padding = (sectionAlignment - offset % sectionAlignment) % sectionAlignment;
+    static const char zeros[sectionAlignment] = {};
+    out.write(zeros, padding);
+    if (!data.empty())
+        out.write((const char*)data.data(), data.size() * sizeof(T));
+    return offset + padding;
+}
+
+bool CompiledScene::write(const char* filename, const Scene& scene, const std::vector<View>& views)
+{
+    CompiledSceneHeader header = {};
+    memcpy(header.magic, "HHSCENE", 8);
+    header.version = CompiledSceneHeader::Version;
+    header.width = scene.w;
+    header.height = scene.h;
+    header.maxDepth = scene.maxDepth;
+    for (int a = 0; a < 3; a++)
+        header.attenuation[a] = scene.attenuation[a];
+
+    std::vector<CompiledSceneView> fileViews(views.size());
+    for (size_t i = 0; i < views.size(); i++)
+    {
+        const View& view = views[i];
+        CompiledSceneView& out = fileViews[i];
+        out = {};
+        for (int a = 0; a < 3; a++)
+        {
+            out.eye[a] = view.eye[a];
+            out.center[a] = view.center[a];
+            out.up[a] = view.up[a];
+        }
+        out.fovy = view.fovy;
+        memcpy(out.output, view.output.data(), std::min(view.output.size(), sizeof(out.output) - 1));
+    }
+
+    const Geometry& g = *scene.geometry;
+    const std::vector<Material>& materials = g.materials;
+    const std::vector<mat4>& transforms = g.transforms;
+
+    std::vector<CompiledSceneMesh> meshes(g.meshes.size());
+    for (size_t i = 0; i < g.meshes.size(); i++)
+    {
+        meshes[i].material = g.meshes[i].material;
+        meshes[i].transform = g.meshes[i].transform;
+    }
+    std::vector<CompiledSceneSphere> spheres(g.spheres.size());
+    for (size_t i = 0; i < g.spheres.size(); i++)
+    {
+        const Sphere& obj = g.spheres[i];
+        spheres[i].material = g.sphereMaterial[i];
+        spheres[i].transform = obj.transform;
+        for (int a = 0; a < 3; a++)
+            spheres[i].sphere[a] = obj.centerPosition[a];
+        spheres[i].sphere[3] = obj.Radius;
+    }
+
+    std::vector<vec3> vertices(g.numVertices);
+    for (uint32_t v = 0; v < g.numVertices; v++)
+        vertices[v] = g.vertex(v);
+    std::vector<uint32_t> indices(g.indices, g.indices + 3 * (size_t)g.numTriangles);
+    std::vector<uint32_t> triangleMesh(g.triangleMesh, g.triangleMesh + g.numTriangles);
+
+    std::vector<CompiledSceneLight> lights(scene.numLights);
+    for (int i = 0; i < scene.numLights; i++)
+    {
+        for (int a = 0; a < 3; a++)
+            lights[i].color[a] = scene.lights[i].lightColor[a];
+        for (int a = 0; a < 4; a++)
+            lights[i].position[a] = scene.lights[i].lightPosition[a];
+    }
+
+    const BVHAccel* bvh = dynamic_cast<const BVHAccel*>(scene.accelerator);
+    std::vector<CompressedBVHNode> nodes;
+    std::vector<uint32_t> bvhPrimitives;
+    if (bvh != nullptr)
+    {
+        nodes.assign(bvh->nodeArray, bvh->nodeArray + bvh->nodeCount);
+        bvhPrimitives = bvh->primitives;
+        Bbox b = bvh->bounds;
+        for (int a = 0; a < 3; a++)
+        {
+            header.bvhBounds[a] = b.pMin[a];
+            header.bvhBounds[3 + a] = b.pMax[a];
+        }
+    }
+
+    header.nViews = (uint32_t)fileViews.size();
+    header.nVertices = (uint32_t)vertices.size();
+    header.nTriangles = (uint32_t)triangleMesh.size();
+    header.nMeshes = (uint32_t)meshes.size();
+    header.nSpheres = (uint32_t)spheres.size();
+    header.nMaterials = (uint32_t)materials.size();
+    header.nTransforms = (uint32_t)transforms.size();
+    header.nLights = (uint32_t)lights.size();
+    header.nBVHNodes = (uint32_t)nodes.size();
+    header.nBVHPrimitives = (uint32_t)bvhPrimitives.size();
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "Unable to Open Compiled Scene File " << filename << "\n";
+        return false;
+    }
+    out.write((const char*)&header, sizeof(header));
+    header.viewOffset = writeSection(out, fileViews);
+    header.vertexOffset = writeSection(out, vertices);
+    header.indexOffset = writeSection(out, indices);
+    header.triangleMeshOffset = writeSection(out, triangleMesh);
+    header.meshOffset = writeSection(out, meshes);
+    header.sphereOffset = writeSection(out, spheres);
+    header.materialOffset = writeSection(out, materials);
+    header.transformOffset = writeSection(out, transforms);
+    header.lightOffset = writeSection(out, lights);
+    header.bvhOffset = writeSection(out, nodes);
+    header.bvhPrimitiveOffset = writeSection(out, bvhPrimitives);
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    if (!out.good())
+    {
+        std::cerr << "Failed Writing Compiled Scene File " << filename << "\n";
+        return false;
+    }
+
+    printf("Compiled Scene written to %s: %u vertices, %u triangles, %u meshes, %u spheres, %u materials, %u transforms, %u BVH nodes\n",
+        filename, header.nVertices, header.nTriangles, header.nMeshes, header.nSpheres, header.nMaterials, header.nTransforms, header.nBVHNodes);
+    return true;
+}
@@ -0,0 +1,173 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "Distribute.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+const int bandsPerWorker = 4; // enough for a slow band to be made up by the others
+
+#ifdef _WIN32
+// one argument of a command line as the C runtime splits it: quoted, with the
+// backslashes before a quote, and before the closing one, doubled
+static std::string quoted(const std::string& arg)
+{
+    std::string result = "\"";
+    size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            backslashes++;
+            continue;
+        }
+        result.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');
+        result += c;
+        backslashes = 0;
+    }
+    result.append(2 * backslashes, '\\');
+    return result + "\"";
+}
+#endif
+
+// runs the program with these arguments, no shell in between, and its output dropped.
+// The exit status, or -1 when it could not be started
+static int run(const std::vector<std::string>& args)
+{
+#ifdef _WIN32
+    std::string commandLine;
+    for (const std::string& arg : args)
+        commandLine += (commandLine.empty() ? "" : " ") + quoted(arg);
+    SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    HANDLE nul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &inherit, OPEN_EXISTING, 0, nullptr);
+    STARTUPINFOA startup = {};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = nul;
+    startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    PROCESS_INFORMATION process = {};
+    BOOL started = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    if (!started) return -1;
+    DWORD status = 1;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    GetExitCodeProcess(process.hProcess, &status);
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    return (int)status;
+#else
+    std::vector<char*> argv;
+    for (const std::string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) return -1;
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+int distribute(const char* self, int workers, const char* sceneFile, const std::vector<std::string>& optionArgs, const Options& options)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    workers = std::max(workers, 1);
+
+    // the geometry options are applied here, the compiled scene has the views with
+    // their cameras and outputs. It stores the BVH when that is the accelerator used,
+    // the bands then map it, otherwise each band builds its own
+    std::vector<View> views;
+    int w, h;
+    std::string compiled = sceneFile;
+    bool temporary = false;
+    try {
+        std::unique_ptr<Job> job = loadJob(sceneFile, options);
+        views = job->views;
+        w = job->scene.w, h = job->scene.h;
+        if (!job->compiled.isOpen()) {
+            compiled = views[0].output + ".hhs";
+            temporary = true;
+            if (!CompiledScene::write(compiled.c_str(), job->scene, job->views)) return 1;
+        }
+    }
+    catch (int) {
+        std::cerr << "Failed Loading " << sceneFile << "\n";
+        return 1;
+    }
+    std::vector<std::string> command = { self, compiled };
+    for (const std::string& arg : optionArgs)
+        if (arg != "--clean-geometry") command.push_back(arg);
+    // workers on one machine share its threads, unless told otherwise
+    if (options.threads == 0) {
+        command.push_back("--threads");
+        command.push_back(std::to_string(std::max(1, (int)std::thread::hardware_concurrency() / workers)));
+    }
+
+    int bands = std::min(workers * bandsPerWorker, h);
+    printf("-----Distributing %d Bands to %d Workers\n\n", bands, workers);
+    fflush(stdout);
+    std::atomic<int> next(0), failed(0);
+    std::mutex printing;
+    std::vector<std::thread> threads;
+    for (int worker = 0; worker < workers; worker++)
+        threads.emplace_back([&, worker] {
+            for (int band = next++; band < bands; band = next++) {
+                auto bandStart = std::chrono::high_resolution_clock::now();
+                std::vector<std::string> args = command;
+                args.push_back("--tile");
+                args.push_back(std::to_string(band) + "/" + std::to_string(bands));
+                int status = run(args);
+                auto bandStop = std::chrono::high_resolution_clock::now();
+                std::lock_guard<std::mutex> lock(printing);
+                if (status != 0) {
+                    failed++;
+                    std::cerr << "Band " << band << " Failed on Worker " << worker << "\n";
+                }
+                else printf("Band %d of %d: worker %d, %lld ms\n", band + 1, bands, worker,
+                    (long long)std::chrono::duration_cast<std::chrono::milliseconds>(bandStop - bandStart).count());
+                fflush(stdout);
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    if (temporary) remove(compiled.c_str());
+
+    // every view from its bands, missing ones stay black
+    for (const View& view : views) {
+        Film film = Film(w, h);
+        for (int band = 0; band < bands; band++) {
+            Options tile = options;
+            tile.tileIndex = band, tile.tileCount = bands;
+            std::string part = partFilename(view.output, partRegion(tile, w, h));
+            if (!film.ReadPart(part.c_str())) {
+                if (failed == 0) std::cerr << "Unable to Read Partial Framebuffer " << part << "\n";
+                failed++;
+            }
+            remove(part.c_str());
+        }
+        film.setOutputFilename(view.output.c_str());
+        film.WriteImage();
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("\nDistributed Render Time: %lld ms\n", (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+    return failed == 0 ? 0 : 1;
+}
@@ -1,75 +1,37 @@
 #include "Film.hpp"
 #include <stdlib.h>
+#include <chrono>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <iostream>
 #include "Object.hpp"
 #include "Bbox.hpp"
-
-extern int numObjects;
-extern int numLights;
-extern vec3 attenuation;
-extern int maxDepth;
+#include "ThreadPool.hpp"
 
 const float bias = 0.01f; // avoid self shadowing
 
 /*---------------------------------------------------------- Intersect ----------------------------------------------------------*/
-inline PII RaySphereIntersect(Ray ray, Object* obj)
-{
-	mat4 invTransf = glm::inverse(obj->transform);
-	vec3 oriTransf = vec3(invTransf * vec4(ray.origin, 1.0f));
-	vec3 dirTransf = vec3(invTransf * vec4(ray.direction, 0.0f));
-
-	float a = glm::dot(dirTransf, dirTransf);
-	float b = 2 * glm::dot(dirTransf, (oriTransf - obj->centerPosition));
-	float c = glm::dot(oriTransf - obj->centerPosition, oriTransf - obj->centerPosition) - obj->Radius * obj->Radius;
-	float delta = b * b - 4 * a * c;
-	if (delta >= 0) {
-		float t1 = (-b + sqrt(delta)) / (2 * a);
-		float t2 = (-b - sqrt(delta)) / (2 * a);
-		float t = fmin(t1, t2);
-		if (0.00001 < t) return { true, t };
-	}
-	return { false, -1.0f };
-}
-
-inline PII RayTriangleIntersect(Ray ray, Object* obj, vec3* vertices)
-{
-	vec3 A = vec3(obj->transform * vec4(vertices[obj->indices[0]], 1));
-	vec3 B = vec3(obj->transform * vec4(vertices[obj->indices[1]], 1));
-	vec3 C = vec3(obj->transform * vec4(vertices[obj->indices[2]], 1));
-
-	vec3 triNormal = glm::normalize(glm::cross(C - A, B - A));
-	float t = (glm::dot(A, triNormal) - glm::dot(ray.origin, triNormal)) / glm::dot(ray.direction, triNormal);
-	vec3 P = ray.origin + t * ray.direction;
-
-	// P in triangle? Barycentric Coord -- triangle area ratio, refer to ravi's lecture 16
-	// for beta
-	vec3 ACcrossAB = glm::cross(C - A, B - A);
-	vec3 ACcrossAP = glm::cross(C - A, P - A);
-	// for gamma
-	vec3 ABcrossAC = -ACcrossAB;
-	vec3 ABcrossAP = glm::cross(B - A, P - A);
-
-	if (glm::dot(ACcrossAB, ACcrossAP) >= 0 && glm::dot(ABcrossAC, ABcrossAP) >= 0) { // beta, gamma >= 0
-		float beta = glm::length(ACcrossAP) / glm::length(ACcrossAB);
-		float gamma = glm::length(ABcrossAP) / glm::length(ABcrossAC);
-		if (beta + gamma <= 1 && 0.00001 < t) return { true, t };
-	}
-	return { false, -1.0f };
-}
-
-Intersection Film::ClosestHitSphere(Ray ray, float hitDistance, Object* closestSphere)
+Intersection Film::ClosestHitSphere(Ray ray, float hitDistance, uint32_t closestSphere)
 {
+	const Geometry* geometry = myActiveScene->geometry;
+	const Sphere* sphere = &geometry->sphere(closestSphere);
+	const mat4& transform = geometry->transforms[sphere->transform];
 	Intersection intersection;
 	intersection.hitDistance = hitDistance;
-	intersection.object = closestSphere;
+	intersection.material = &geometry->material(closestSphere);
 
-	mat4 invTransf = glm::inverse(closestSphere->transform);
+	const mat4& invTransf = geometry->inverseTransforms[sphere->transform];
 	vec3 oriTransf = vec3(invTransf * vec4(ray.origin, 1.0f));
 	vec3 dirTransf = vec3(invTransf * vec4(ray.direction, 0.0f));
 
 	vec3 hitPosition = oriTransf + hitDistance * dirTransf;
-	vec3 sphereNormalObj = hitPosition - closestSphere->centerPosition;
+	vec3 sphereNormalObj = hitPosition - sphere->centerPosition;
 
-	vec4 hitPointWorld = closestSphere->transform * vec4(hitPosition, 1.0f);
+	vec4 hitPointWorld = transform * vec4(hitPosition, 1.0f);
 	vec4 sphereNormalWorld = glm::transpose(invTransf) * vec4(sphereNormalObj, 0.0f);
 
 	intersection.WorldPosition = vec3(hitPointWorld / hitPointWorld.w);
@@ -78,15 +40,18 @@ Intersection Film::ClosestHitSphere(Ray ray, float hitDistance, Object* closestS
 	return intersection;
 }
 
-Intersection Film::ClosestHitTriangle(Ray ray, float hitDistance, Object* closestTriangle, vec3* vertices)
+Intersection Film::ClosestHitTriangle(Ray ray, float hitDistance, uint32_t closestTriangle)
 {
+	const Geometry* geometry = myActiveScene->geometry;
 	Intersection intersection;
 	intersection.hitDistance = hitDistance;
-	intersection.object = closestTriangle;
+	intersection.material = &geometry->material(closestTriangle);
 
-	vec3 A = vec3(closestTriangle->transform * vec4(vertices[closestTriangle->indices[0]], 1));
-	vec3 B = vec3(closestTriangle->transform * vec4(vertices[closestTriangle->indices[1]], 1));
-	vec3 C = vec3(closestTriangle->transform * vec4(vertices[closestTriangle->indices[2]], 1));
+	// world space vertices
+	const uint32_t* v = geometry->indices + 3 * (size_t)closestTriangle;
+	vec3 A = geometry->vertex(v[0]);
+	vec3 B = geometry->vertex(v[1]);
+	vec3 C = geometry->vertex(v[2]);
 
 	vec3 triNormal = glm::normalize(glm::cross(B - A, C - A));
 	vec3 P = ray.origin + hitDistance * ray.direction;
@@ -104,61 +69,6 @@ Intersection Film::Miss(Ray ray)
 	return intersection;
 }
 
-Intersection Film::findIntersection(Ray ray, Object* object)
-{
-	if (object->type == sphere)
-	{
-		if (RaySphereIntersect(ray, object).first)
-		{
-			float t = RaySphereIntersect(ray, object).second;
-			return ClosestHitSphere(ray, t, object);
-		}
-		else return Miss(ray);
-	}
-	else
-	{
-		if (RayTriangleIntersect(ray, object, myActiveScene->vertices).first)
-		{
-			float t1 = RayTriangleIntersect(ray, object, myActiveScene->vertices).second;
-			return ClosestHitTriangle(ray, t1, object, myActiveScene->vertices);
-		}
-		else return Miss(ray);
-	}
-}
-
-Intersection Film::getIntersection(BVHBuildNode* node, Ray ray)
-{
-	float x = 0, y = 0, z = 0;
-	if (ray.direction.x != 0.0f) x = 1.0f / ray.direction.x;
-	if (ray.direction.y != 0.0f) y = 1.0f / ray.direction.y;
-	if (ray.direction.z != 0.0f) z = 1.0f / ray.direction.z;
-	vec3 invDir(x, y, z);
-
-	std::array<int, 3> dirIsNeg;
-	dirIsNeg[0] = ray.direction.x > 0 ? 0 : 1;
-	dirIsNeg[1] = ray.direction.y > 0 ? 0 : 1;
-	dirIsNeg[2] = ray.direction.z > 0 ? 0 : 1;
-
-	if (!node->bounds.IntersectionP(ray, invDir, dirIsNeg))
-	{
-		return Miss(ray);
-	}
-
-	if (node->left == nullptr && node->right == nullptr)
-	{
-		return findIntersection(ray, node->object);
-	}
-
-	Intersection left = getIntersection(node->left, ray);
-	Intersection right = getIntersection(node->right, ray);
-	if (left.hitDistance > 0 && right.hitDistance > 0)
-		return left.hitDistance <= right.hitDistance ? left : right;
-	else if (left.hitDistance > 0)
-		return left;
-	else
-		return right;
-}
-
 /*---------------------------------------------------------- Color ----------------------------------------------------------*/
 static uint32_t ConvertToRGB(const vec3& color)
 {
@@ -180,28 +90,32 @@ inline vec3 ComputeColor(vec3 lightDir, vec3 lightCol, vec3 normal, vec3 halfvec
 }
 
 /*---------------------------------------------------------- Render ----------------------------------------------------------*/
-Intersection Film::TraceRay(Ray ray, BVHAccel* bvh)
+Intersection Film::TraceRay(Ray ray)
 {
-	Intersection isect = getIntersection(bvh->root, ray);
-	return isect;
+	float hitDistance;
+	uint32_t prim;
+	if (!myActiveScene->accelerator->Intersect(ray, hitDistance, prim)) return Miss(ray);
+
+	if (myActiveScene->geometry->isTriangle(prim)) return ClosestHitTriangle(ray, hitDistance, prim);
+	else return ClosestHitSphere(ray, hitDistance, prim);
 }
 
 vec3 Film::FindColor(Ray ray, int currDepth)
 {
 	vec3 currDepthColor(0.0f);
-	if (currDepth == maxDepth) return currDepthColor;
+	if (currDepth == myActiveScene->maxDepth) return currDepthColor;
 	
 	vec3 bgColor(0.0f);
-	Intersection intersection = TraceRay(ray, myActiveScene->bvh);
+	Intersection intersection = TraceRay(ray);
 	if (intersection.hitDistance <= 0.0f) return bgColor;
 
-	Object* object = intersection.object;
+	const Material* material = intersection.material;
 
-	vec3 objDiffuse = object->material.diffuse;
-	vec3 objSpecular = object->material.specular;
+	vec3 objDiffuse = material->diffuse;
+	vec3 objSpecular = material->specular;
 	vec3 rayDir = glm::normalize(ray.direction); // from eye to hit point
 
-	for (int i = 0; i < numLights; i++) {
+	for (int i = 0; i < myActiveScene->numLights; i++) {
 		Light* curr_light = &(myActiveScene->lights[i]);
 		vec3 lightDir = vec3(0.0f);
 		float visibility = 1.0f;
@@ -213,6 +127,7 @@ vec3 Film::FindColor(Ray ray, int currDepth)
 		else {
 			lightDir = vec3(curr_light->lightPosition) - intersection.WorldPosition; // from hit point to light
 			float dist = glm::length(lightDir);
+			const vec3& attenuation = myActiveScene->attenuation;
 			attnCoeff = 1.0f / (attenuation.x + attenuation.y * dist + attenuation.z * dist * dist);
 			lightDir = glm::normalize(lightDir);
 		}
@@ -221,7 +136,7 @@ vec3 Film::FindColor(Ray ray, int currDepth)
 
 		// visibility & shadow
 		Ray toLight(intersection.WorldPosition, lightDir);
-		Intersection nextIntersection = TraceRay(toLight, myActiveScene->bvh);
+		Intersection nextIntersection = TraceRay(toLight);
 
 		if (nextIntersection.hitDistance > 0.0f) {
 			if (curr_light->lightPosition.w != 0) {
@@ -232,11 +147,11 @@ vec3 Film::FindColor(Ray ray, int currDepth)
 			}
 			else visibility = 0;
 		}
-		currDepthColor += visibility * attnCoeff * ComputeColor(lightDir, lightCol, intersection.WorldNormal, halfvec, objDiffuse, objSpecular, object->material.shininess);
+		currDepthColor += visibility * attnCoeff * ComputeColor(lightDir, lightCol, intersection.WorldNormal, halfvec, objDiffuse, objSpecular, material->shininess);
 	
 	}
 
-	currDepthColor += object->material.emission + object->material.ambient;
+	currDepthColor += material->emission + material->ambient;
 	// add next depth color
 	vec3 reflDir = glm::normalize(rayDir - 2 * glm::dot(intersection.WorldNormal, rayDir) * intersection.WorldNormal);
 	Ray reflRay(intersection.WorldPosition, reflDir);
@@ -245,49 +160,525 @@ vec3 Film::FindColor(Ray ray, int currDepth)
 	return currDepthColor;
 }
 
-void Film::Render(Scene scene, Camera camera)
+void Film::StorePixel(int x, int y, vec3 color)
 {
-	myActiveCamera = &camera;
-	myActiveScene = &scene;
+	int base = 3 * (x + y * w);
+	color = glm::clamp(color, vec3(0.0f), vec3(1.0f));
+	uint32_t result_color = ConvertToRGB(color);
+
+	pixels[base] = (uint8_t)(result_color >> 16);
+	pixels[base + 1] = (uint8_t)(result_color >> 8);
+	pixels[base + 2] = (uint8_t)result_color;
+}
 
-	int printVal = 5;
+void Film::RenderPixel(int x, int y)
+{
+	Ray ray = myActiveCamera->RayThruPixel(x, y);
+	vec3 color = FindColor(ray);
+	if (!baseColor.empty()) baseColor[x + y * w] = glm::clamp(color, vec3(0.0f), vec3(1.0f));
+	StorePixel(x, y, color);
+}
 
-	myActiveScene->buildBVH();
+// Points of the R2 sequence (Roberts 2018), evenly spread over the pixel for any
+// count, shifted per pixel so neighbours do not share a pattern.
+static vec2 pixelSample(int x, int y, int i)
+{
+	uint32_t hash = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u;
+	hash = (hash ^ (hash >> 15)) * 0x2c1b3c6du;
+	hash ^= hash >> 12;
+	vec2 shift((hash & 0xffff) / 65536.0f, (hash >> 16) / 65536.0f);
+	vec2 p = shift + (float)i * vec2(0.7548776662f, 0.5698402910f);
+	return p - glm::floor(p);
+}
 
-	int pix = w * h;
-	for (int y = 0; y < h; y++)
+// calls visit(i, j) for the cells of an nx by ny grid, row by row or in Morton order
+template <class Visit>
+static void forEachCell(int nx, int ny, Film::PixelOrder order, const Visit& visit)
+{
+	if (order == Film::PixelOrder::Scan) {
+		for (int j = 0; j < ny; j++)
+			for (int i = 0; i < nx; i++)
+				visit(i, j);
+		return;
+	}
+	int side = 1;
+	while (side < nx || side < ny) side *= 2;
+	for (uint32_t code = 0; code < (uint32_t)(side * side); code++)
 	{
-		for (int x = 0; x < w; x++)
+		// even bits are i, odd bits are j
+		int i = 0, j = 0;
+		for (int bit = 0; (side >> bit) > 1; bit++) {
+			i |= ((code >> (2 * bit)) & 1) << bit;
+			j |= ((code >> (2 * bit + 1)) & 1) << bit;
+		}
+		if (i < nx && j < ny) visit(i, j);
+	}
+}
+
+// position d along the Hilbert curve that fills a side by side grid, side a power of 2
+static void hilbertCell(int side, uint32_t d, int& i, int& j)
+{
+	i = j = 0;
+	for (int s = 1; s < side; s *= 2, d /= 4)
+	{
+		int ri = 1 & (d / 2), rj = 1 & (d ^ ri);
+		if (rj == 0) {
+			if (ri == 1) {
+				i = s - 1 - i;
+				j = s - 1 - j;
+			}
+			std::swap(i, j);
+		}
+		i += s * ri;
+		j += s * rj;
+	}
+}
+
+// Pixels that differ from a 4-neighbour by more than the threshold in some channel
+// get samples in groups of 4 besides their center one, until the standard error of
+// their mean is below half the threshold or they have aaMaxSamples. Reads the
+// neighbours from baseColor, which this pass does not change, those outside the
+// region from its apron.
+void Film::RenderTileAA(const Tile& tile)
+{
+	const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	forEachCell(tile.x1 - tile.x0, tile.y1 - tile.y0, pixelOrder, [&](int i, int j) {
+		int x = tile.x0 + i, y = tile.y0 + j;
+		vec3 center = baseColor[x + y * w];
+		float contrast = 0.0f;
+		for (const int* d : neighbours)
+		{
+			int nx = x + d[0], ny = y + d[1];
+			if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+			vec3 diff = glm::abs(baseColor[nx + ny * w] - center);
+			contrast = std::max(contrast, std::max(diff.r, std::max(diff.g, diff.b)));
+		}
+		if (contrast <= aaThreshold) return;
+
+		vec3 sum = center, sumSquares = center * center;
+		int n = 1;
+		while (n < aaMaxSamples)
 		{
-			int base = 3 * (x + y * w);
-			Ray ray = myActiveCamera->RayThruPixel(x, y);
-			vec3 color = FindColor(ray);
-			color = glm::clamp(color, vec3(0.0f), vec3(1.0f));
-			uint32_t result_color = ConvertToRGB(color);
-
-			pixels[base] = (uint8_t)(result_color >> 16);
-			pixels[base + 1] = (uint8_t)(result_color >> 8);
-			pixels[base + 2] = (uint8_t)result_color;
-
-			// progress bar
-			int finished = (y * w + x) / (float)pix * 100;
-			if (finished % 100 >= printVal) {
-				printf("Ray Tracing Progress: %i %%\n", finished);
-				printVal += 5;
+			for (int k = 0; k < 4 && n < aaMaxSamples; k++, n++)
+			{
+				vec2 p = pixelSample(x, y, n);
+				vec3 color = glm::clamp(FindColor(myActiveCamera->RayThruPoint(x + p.x, y + p.y)), vec3(0.0f), vec3(1.0f));
+				sum += color;
+				sumSquares += color * color;
 			}
+			vec3 mean = sum / (float)n;
+			vec3 variance = glm::max(sumSquares / (float)n - mean * mean, vec3(0.0f));
+			float maxVariance = std::max(variance.r, std::max(variance.g, variance.b));
+			if (std::sqrt(maxVariance / n) < 0.5f * aaThreshold) break;
+		}
+		StorePixel(x, y, sum / (float)n);
+		aaPixels++;
+		aaSamples += n - 1;
+	});
+}
+
+// The pixels just outside the region, traced into baseColor only, so the edge pixels
+// of a part see the neighbours they have in the whole image and are refined alike
+void Film::TraceApron()
+{
+	std::vector<std::pair<int, int>> apron;
+	for (int x = region.x0; x < region.x1; x++) {
+		if (region.y0 > 0) apron.push_back({ x, region.y0 - 1 });
+		if (region.y1 < h) apron.push_back({ x, region.y1 });
+	}
+	for (int y = region.y0; y < region.y1; y++) {
+		if (region.x0 > 0) apron.push_back({ region.x0 - 1, y });
+		if (region.x1 < w) apron.push_back({ region.x1, y });
+	}
+	ThreadPool::global().parallelFor(apron.size(), 64, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			int x = apron[i].first, y = apron[i].second;
+			baseColor[x + y * w] = glm::clamp(FindColor(myActiveCamera->RayThruPixel(x, y)), vec3(0.0f), vec3(1.0f));
+		}
+	});
+}
+
+const int costBlock = 8; // the stride of the timed pass
+
+// Traces the pixels of the tile on a grid of the given stride, skipping those a
+// coarser pass traced, and fills the stride x stride block of each with its color.
+// Returns the number of pixels traced.
+size_t Film::RenderTile(const Tile& tile, int stride, int previousStride)
+{
+	const bool timed = costSchedule && stride == costBlock;
+	size_t traced = 0;
+	int nx = (tile.x1 - tile.x0 + stride - 1) / stride, ny = (tile.y1 - tile.y0 + stride - 1) / stride;
+	forEachCell(nx, ny, pixelOrder, [&](int i, int j) {
+		int x = tile.x0 + i * stride, y = tile.y0 + j * stride;
+		if (previousStride != 0 && (x - region.x0) % previousStride == 0 && (y - region.y0) % previousStride == 0) return;
+		if (timed) {
+			auto start = std::chrono::high_resolution_clock::now();
+			RenderPixel(x, y);
+			blockCost[BlockIndex(x, y)] =
+				std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
 		}
+		else RenderPixel(x, y);
+		traced++;
+		if (stride > 1)
+			for (int by = y; by < std::min(y + stride, tile.y1); by++)
+				for (int bx = x; bx < std::min(x + stride, tile.x1); bx++)
+					if (bx != x || by != y) memcpy(&pixels[3 * (bx + by * w)], &pixels[3 * (x + y * w)], 3);
+	});
+	return traced;
+}
+
+int Film::BlockIndex(int x, int y) const
+{
+	int blocksPerRow = (region.x1 - region.x0 + costBlock - 1) / costBlock;
+	return (x - region.x0) / costBlock + (y - region.y0) / costBlock * blocksPerRow;
+}
+
+void Film::MarkBlocks(const Tile& tile, uint8_t stage)
+{
+	for (int y = tile.y0; y < tile.y1; y += costBlock)
+		for (int x = tile.x0; x < tile.x1; x += costBlock)
+			blockStage[BlockIndex(x, y)] = stage;
+}
+
+// the tiles whose blocks are all below the stage, and the blocks below it of the others
+std::vector<Tile> Film::PendingTiles(const std::vector<Tile>& tiles, uint8_t stage) const
+{
+	std::vector<Tile> pending, blocks;
+	for (const Tile& tile : tiles)
+	{
+		blocks.clear();
+		for (int y = tile.y0; y < tile.y1; y += costBlock)
+			for (int x = tile.x0; x < tile.x1; x += costBlock)
+				if (blockStage[BlockIndex(x, y)] < stage)
+					blocks.push_back({ x, y, std::min(x + costBlock, tile.x1), std::min(y + costBlock, tile.y1) });
+		size_t all = (size_t)((tile.x1 - tile.x0 + costBlock - 1) / costBlock) * ((tile.y1 - tile.y0 + costBlock - 1) / costBlock);
+		if (blocks.size() == all) pending.push_back(tile);
+		else pending.insert(pending.end(), blocks.begin(), blocks.end());
 	}
+	return pending;
+}
+
+std::vector<Tile> Film::ScheduleTiles(const std::vector<Tile>& tiles, size_t nThreads) const
+{
+	auto costOf = [&](const Tile& tile) {
+		float cost = 0.0f;
+		for (int y = tile.y0; y < tile.y1; y += costBlock)
+			for (int x = tile.x0; x < tile.x1; x += costBlock)
+				cost += blockCost[BlockIndex(x, y)];
+		return cost;
+	};
+	float total = 0.0f;
+	for (float cost : blockCost) total += cost;
+
+	// a tile above 1/16 of a thread's share would be a long tail if it came last
+	float limit = total / (16.0f * nThreads);
+	std::vector<std::pair<float, Tile>> work;
+	size_t nSplit = 0;
+	for (const Tile& tile : tiles)
+	{
+		float cost = costOf(tile);
+		if (cost <= limit || (tile.x1 - tile.x0 <= costBlock && tile.y1 - tile.y0 <= costBlock)) {
+			work.push_back({ cost, tile });
+			continue;
+		}
+		nSplit++;
+		for (int y = tile.y0; y < tile.y1; y += costBlock)
+			for (int x = tile.x0; x < tile.x1; x += costBlock) {
+				Tile block = { x, y, std::min(x + costBlock, tile.x1), std::min(y + costBlock, tile.y1) };
+				work.push_back({ costOf(block), block });
+			}
+	}
+	std::stable_sort(work.begin(), work.end(),
+		[](const std::pair<float, Tile>& a, const std::pair<float, Tile>& b) { return a.first > b.first; });
+
+	std::vector<Tile> scheduled;
+	for (const auto& entry : work) scheduled.push_back(entry.second);
+	printf("Tile Schedule: %zu tiles, %zu split into %ix%i blocks, costliest %.2f %% of the predicted time\n",
+		scheduled.size(), nSplit, costBlock, costBlock, total > 0.0f ? 100.0f * work[0].first / total : 0.0f);
+	return scheduled;
+}
+
+void Film::WriteImage() const
+{
+	if (outputFilename == nullptr) return;
 	FreeImage_Initialise();
 	FIBITMAP* img = FreeImage_ConvertFromRawBits(pixels, w, h, w * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, true);
 
 	FreeImage_Save(FIF_PNG, img, outputFilename, 0);
+	FreeImage_Unload(img);
 	FreeImage_DeInitialise();
+}
 
+bool Film::WritePart(const char* filename) const
+{
+	FILE* file = fopen(filename, "wb");
+	if (file == nullptr) return false;
+	fprintf(file, "P6\n# HeliosHunter part %d %d %d %d of %d %d\n%d %d\n255\n",
+		region.x0, region.y0, region.x1, region.y1, w, h, region.x1 - region.x0, region.y1 - region.y0);
+	std::vector<BYTE> row(3 * (size_t)(region.x1 - region.x0));
+	for (int y = region.y0; y < region.y1; y++)
+	{
+		for (int x = region.x0; x < region.x1; x++)
+			for (int c = 0; c < 3; c++)
+				row[3 * (x - region.x0) + c] = pixel(x, y)[2 - c]; // BGR to RGB
+		fwrite(row.data(), 1, row.size(), file);
+	}
+	return fclose(file) == 0;
 }
 
+bool Film::ReadPart(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == nullptr) return false;
+	Tile part = { 0, 0, 0, 0 };
+	int partW = 0, partH = 0, rowW = 0, rowH = 0;
+	bool valid = fscanf(file, "P6 # HeliosHunter part %d %d %d %d of %d %d %d %d 255",
+		&part.x0, &part.y0, &part.x1, &part.y1, &partW, &partH, &rowW, &rowH) == 8 && fgetc(file) == '\n'
+		&& partW == w && partH == h && 0 <= part.x0 && part.x0 < part.x1 && part.x1 <= w && 0 <= part.y0 && part.y0 < part.y1 && part.y1 <= h
+		&& rowW == part.x1 - part.x0 && rowH == part.y1 - part.y0;
+	std::vector<BYTE> row(valid ? 3 * (size_t)rowW : 0);
+	for (int y = part.y0; valid && y < part.y1; y++)
+	{
+		valid = fread(row.data(), 1, row.size(), file) == row.size();
+		for (int x = part.x0; valid && x < part.x1; x++)
+			for (int c = 0; c < 3; c++)
+				pixels[3 * (x + y * w) + c] = row[3 * (x - part.x0) + 2 - c];
+	}
+	fclose(file);
+	return valid;
+}
 
+volatile std::sig_atomic_t Film::stopRequested = 0;
 
+// Header of a checkpoint, followed by the block stages, the framebuffer, and with
+// anti-aliasing the one sample colors it compares. A checkpoint only resumes the
+// render of the same scene, camera, image size, region and anti-aliasing
+struct CheckpointHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t sceneHash;
+	float camera[10];
+	int32_t w, h;
+	Tile region;
+	int32_t aaMaxSamples;
+	float aaThreshold;
+	uint32_t nBlocks;
+};
+
+static const char checkpointMagic[4] = { 'H', 'H', 'C', 'P' };
+static const uint32_t checkpointVersion = 2;
+
+// written next to the checkpoint and renamed over it, a kill while writing leaves the
+// previous one
+bool Film::WriteCheckpoint() const
+{
+	std::string temporary = std::string(checkpointFilename) + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr) return false;
+	CheckpointHeader header;
+	memcpy(header.magic, checkpointMagic, 4);
+	header.version = checkpointVersion;
+	header.sceneHash = checkpointScene;
+	memcpy(header.camera, checkpointCamera, sizeof(header.camera));
+	header.w = w, header.h = h;
+	header.region = region;
+	header.aaMaxSamples = aaMaxSamples;
+	header.aaThreshold = aaThreshold;
+	header.nBlocks = (uint32_t)blockStage.size();
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(blockStage.data(), 1, blockStage.size(), file) == blockStage.size()
+		&& fwrite(pixels, 3, (size_t)w * h, file) == (size_t)w * h
+		&& fwrite(baseColor.data(), sizeof(vec3), baseColor.size(), file) == baseColor.size();
+	written = fclose(file) == 0 && written;
+	if (written && rename(temporary.c_str(), checkpointFilename) != 0) {
+		remove(checkpointFilename); // rename does not replace on Windows
+		written = rename(temporary.c_str(), checkpointFilename) == 0;
+	}
+	if (!written) remove(temporary.c_str());
+	return written;
+}
 
+bool Film::ReadCheckpoint()
+{
+	FILE* file = fopen(checkpointFilename, "rb");
+	if (file == nullptr) return false;
+	CheckpointHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, checkpointMagic, 4) == 0
+		&& header.version == checkpointVersion && header.sceneHash == checkpointScene
+		&& memcmp(header.camera, checkpointCamera, sizeof(header.camera)) == 0 && header.w == w && header.h == h
+		&& header.region.x0 == region.x0 && header.region.y0 == region.y0 && header.region.x1 == region.x1 && header.region.y1 == region.y1
+		&& header.aaMaxSamples == aaMaxSamples && header.aaThreshold == aaThreshold && header.nBlocks == blockStage.size();
+	std::vector<uint8_t> stages(valid ? blockStage.size() : 0);
+	std::vector<BYTE> framebuffer(valid ? 3 * (size_t)w * h : 0);
+	std::vector<vec3> colors(valid ? baseColor.size() : 0);
+	valid = valid && fread(stages.data(), 1, stages.size(), file) == stages.size()
+		&& fread(framebuffer.data(), 1, framebuffer.size(), file) == framebuffer.size()
+		&& fread(colors.data(), sizeof(vec3), colors.size(), file) == colors.size();
+	fclose(file);
+	if (!valid) {
+		printf("Checkpoint %s is not of this render, starting over\n", checkpointFilename);
+		return false;
+	}
+	blockStage = std::move(stages);
+	memcpy(pixels, framebuffer.data(), framebuffer.size());
+	baseColor = std::move(colors);
+	return true;
+}
 
+// The image is split into tiles, traced in parallel a batch of tiles at a time.
+// Between batches no pixel is being written, that is where previews are saved, the
+// page cache evicts, checkpoints are saved and the time budget and stop requests are
+// checked. Without those a pass is a single batch. The accelerator of the scene is built beforehand, once for all views.
+void Film::Render(Scene scene, Camera camera)
+{
+	myActiveCamera = &camera;
+	myActiveScene = &scene;
 
+	std::atomic<int> printVal(5);
+	std::mutex printing;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	auto elapsedSeconds = [&]() {
+		return std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+	};
+
+	const int tileSize = 16; // a multiple of the coarsest stride
+	std::vector<Tile> tiles;
+	const int regionW = std::max(0, region.x1 - region.x0), regionH = std::max(0, region.y1 - region.y0);
+	auto addTile = [&](int i, int j) {
+		int x = region.x0 + i * tileSize, y = region.y0 + j * tileSize;
+		tiles.push_back({ x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1) });
+	};
+	int tilesX = (regionW + tileSize - 1) / tileSize, tilesY = (regionH + tileSize - 1) / tileSize;
+	if (tileOrder == TileOrder::Hilbert) {
+		int side = 1;
+		while (side < tilesX || side < tilesY) side *= 2;
+		for (uint32_t d = 0; d < (uint32_t)(side * side); d++) {
+			int i, j;
+			hilbertCell(side, d, i, j);
+			if (i < tilesX && j < tilesY) addTile(i, j);
+		}
+	}
+	else {
+		for (int j = 0; j < tilesY; j++)
+			for (int i = 0; i < tilesX; i++)
+				addTile(i, j);
+	}
 
+	ThreadPool& pool = ThreadPool::global();
+	PageCache* pageCache = myActiveScene->geometry->pageCache;
+	const bool batched = pageCache != nullptr || timeBudget > 0.0f || previewInterval > 0.0f || checkpointFilename != nullptr;
+	std::atomic<size_t> traced(0);
+	int pix = std::max(1, regionW * regionH);
+	float lastPreview = 0.0f, lastCheckpoint = 0.0f;
+	bool stopped = false;
+	// strides of the passes, 0 is the anti-aliasing pass
+	std::vector<int> passes;
+	if (progressive) passes = { 8, 4, 2, 1 };
+	else if (costSchedule) passes = { costBlock, 1 };
+	else passes = { 1 };
+	if (costSchedule) blockCost.assign((size_t)((regionW + costBlock - 1) / costBlock) * ((regionH + costBlock - 1) / costBlock), 0.0f);
+	if (aaMaxSamples > 1) {
+		passes.push_back(0);
+		baseColor.assign((size_t)w * h, vec3(0.0f));
+	}
+	const uint8_t finalStage = aaMaxSamples > 1 ? 2 : 1;
+	bool resumed = false;
+	const std::vector<Tile> allTiles = tiles;
+	if (checkpointFilename != nullptr) {
+		blockStage.assign((size_t)((regionW + costBlock - 1) / costBlock) * ((regionH + costBlock - 1) / costBlock), 0);
+		resumed = resume && ReadCheckpoint();
+	}
+	// "n of m blocks finished", and how many more await anti-aliasing
+	auto blocksDone = [&]() {
+		size_t finished = std::count(blockStage.begin(), blockStage.end(), finalStage);
+		std::string done = std::to_string(finished) + " of " + std::to_string(blockStage.size()) + " blocks finished";
+		if (finalStage == 2) done += ", " + std::to_string(std::count(blockStage.begin(), blockStage.end(), 1)) + " more traced";
+		return done;
+	};
+	if (resumed) {
+		size_t tracedBefore = 0;
+		for (int y = region.y0; y < region.y1; y += costBlock)
+			for (int x = region.x0; x < region.x1; x += costBlock)
+				if (blockStage[BlockIndex(x, y)] > 0)
+					tracedBefore += (size_t)(std::min(x + costBlock, region.x1) - x) * (std::min(y + costBlock, region.y1) - y);
+		traced = tracedBefore;
+		tiles = PendingTiles(allTiles, 1);
+		printf("Resumed from %s: %s\n", checkpointFilename, blocksDone().c_str());
+	}
+	size_t tilesDone = 0; // of the last pass, whole batches
+	for (size_t pass = 0; pass < passes.size(); pass++)
+	{
+		int stride = passes[pass];
+		int previousStride = pass > 0 ? passes[pass - 1] : 0;
+		if (stopped) break;
+		if (costSchedule && pass == 1) tiles = ScheduleTiles(tiles, pool.size());
+		if (resumed && stride == 0) tiles = PendingTiles(allTiles, 2);
+		if (stride == 0) TraceApron();
+		const size_t batchSize = batched ? 4 * (size_t)pool.size() : tiles.size();
+		for (size_t first = 0; first < tiles.size() && !stopped; first += batchSize)
+		{
+			if (pageCache != nullptr) pageCache->collect();
+			size_t count = std::min(batchSize, tiles.size() - first);
+			bool lastPass = pass + 1 == passes.size();
+			pool.parallelFor(count, 1, [&](size_t begin, size_t end) {
+				for (size_t t = first + begin; t < first + end; t++) {
+					if (stride == 0) {
+						RenderTileAA(tiles[t]);
+						if (!blockStage.empty()) MarkBlocks(tiles[t], 2);
+						if (tileDone) tileDone(tiles[t]);
+						continue;
+					}
+					size_t tracedNow = traced += RenderTile(tiles[t], stride, previousStride);
+					if (stride == 1 && !blockStage.empty()) MarkBlocks(tiles[t], 1);
+					if (lastPass && tileDone) tileDone(tiles[t]);
+					// progress bar
+					int finished = tracedNow / (float)pix * 100;
+					if (finished < printVal) continue;
+					std::lock_guard<std::mutex> lock(printing);
+					for (; finished >= printVal; printVal += 5)
+						printf("Ray Tracing Progress: %i %%\n", printVal.load());
+				}
+			});
+			if (lastPass) tilesDone = first + count;
+			int finished = traced / (float)pix * 100;
+
+			float elapsed = elapsedSeconds();
+			if (stopRequested) {
+				if (stride == 0) printf("Stop requested in the anti-aliasing pass\n");
+				else printf("Stop requested in the 1/%i pass, %i %% of the pixels traced\n", stride, finished);
+				stopped = true;
+			}
+			else if (timeBudget > 0.0f && elapsed >= timeBudget && (stride != 1 || first + count < tiles.size())) {
+				if (stride == 0) printf("Time Budget of %.1f s reached in the anti-aliasing pass\n", timeBudget);
+				else printf("Time Budget of %.1f s reached in the 1/%i pass, %i %% of the pixels traced\n", timeBudget, stride, finished);
+				stopped = true;
+			}
+			else if (previewInterval > 0.0f && elapsed - lastPreview >= previewInterval) {
+				WriteImage();
+				lastPreview = elapsed;
+				if (stride == 0) printf("Preview written: anti-aliasing pass, %.1f s\n", elapsed);
+				else printf("Preview written: 1/%i pass, %i %% of the pixels traced, %.1f s\n", stride, finished, elapsed);
+			}
+			if (checkpointFilename != nullptr && (stopped || (checkpointInterval > 0.0f && elapsed - lastCheckpoint >= checkpointInterval))) {
+				if (WriteCheckpoint()) printf("Checkpoint written: %s, %.1f s\n", blocksDone().c_str(), elapsed);
+				else std::cerr << "Unable to Write Checkpoint " << checkpointFilename << "\n";
+				lastCheckpoint = elapsed;
+			}
+		}
+	}
+	// the tiles the budget left unfinished, as far as they got
+	if (tileDone)
+		for (size_t t = tilesDone; t < tiles.size(); t++)
+			tileDone(tiles[t]);
+	if (aaMaxSamples > 1)
+		printf("Anti-aliasing: %.1f %% of the pixels refined, %.2f samples per pixel\n",
+			100.0 * aaPixels / pix, 1.0 + (double)aaSamples / pix);
+	auto stop = std::chrono::high_resolution_clock::now();
+	printf("Ray Tracing Time: %lld ms\n",
+		(long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+	if (checkpointFilename != nullptr && !stopped) remove(checkpointFilename);
+
+	WriteImage();
+}
@@ -0,0 +1,150 @@
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "Geometry.hpp"
+
+static size_t hashWords(const uint32_t* words, int count)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < count; i++)
+        h = (h ^ words[i]) * 0x100000001b3ull;
+    return (size_t)(h ^ (h >> 32));
+}
+
+// positions are equal when their floats are, so -0 and 0 weld
+struct PositionHash
+{
+    size_t operator()(const vec3& p) const
+    {
+        vec3 q = p + vec3(0.0f); // -0 + 0 = 0
+        uint32_t words[3];
+        memcpy(words, &q[0], sizeof(words));
+        return hashWords(words, 3);
+    }
+};
+
+// a triangle is its vertices rotated to start at the smallest index, which keeps the
+// winding (the side its normal faces), plus the material it is shaded with
+struct TriangleKey
+{
+    uint32_t words[4];
+    bool operator==(const TriangleKey& o) const { return memcmp(words, o.words, sizeof(words)) == 0; }
+};
+
+struct TriangleKeyHash
+{
+    size_t operator()(const TriangleKey& k) const { return hashWords(k.words, 4); }
+};
+
+struct SphereKey
+{
+    uint32_t words[6];
+    bool operator==(const SphereKey& o) const { return memcmp(words, o.words, sizeof(words)) == 0; }
+};
+
+struct SphereKeyHash
+{
+    size_t operator()(const SphereKey& k) const { return hashWords(k.words, 6); }
+};
+
+void Geometry::cleanup()
+{
+    printf("-----Cleaning Geometry...\n\n");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // every vertex points at the first one with its position
+    std::vector<uint32_t> weld(numVertices);
+    std::unordered_map<vec3, uint32_t, PositionHash> firstAt;
+    firstAt.reserve(numVertices);
+    for (uint32_t v = 0; v < numVertices; v++)
+        weld[v] = firstAt.emplace(vertices[v], v).first->second;
+    size_t nWelded = numVertices - firstAt.size();
+
+    // triangles in their order, without the zero area and repeated ones
+    std::unordered_set<TriangleKey, TriangleKeyHash> seenTriangles;
+    seenTriangles.reserve(numTriangles);
+    uint32_t nTriangles = 0;
+    size_t nDegenerate = 0, nDuplicate = 0;
+    for (uint32_t t = 0; t < numTriangles; t++)
+    {
+        uint32_t v[3];
+        for (int k = 0; k < 3; k++)
+            v[k] = weld[indices[3 * (size_t)t + k]];
+        vec3 n = glm::cross(vertices[v[1]] - vertices[v[0]], vertices[v[2]] - vertices[v[0]]);
+        if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0] || (n.x == 0.0f && n.y == 0.0f && n.z == 0.0f))
+        {
+            nDegenerate++;
+            continue;
+        }
+        int first = v[0] < v[1] ? (v[0] < v[2] ? 0 : 2) : (v[1] < v[2] ? 1 : 2);
+        TriangleKey key = { { v[first], v[(first + 1) % 3], v[(first + 2) % 3], meshes[triangleMesh[t]].material } };
+        if (!seenTriangles.insert(key).second)
+        {
+            nDuplicate++;
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+            indices[3 * (size_t)nTriangles + k] = v[k];
+        triangleMesh[nTriangles++] = triangleMesh[t];
+    }
+
+    // keep the vertices still in use, in their order
+    std::vector<uint32_t> newIndex(numVertices, UINT32_MAX);
+    for (size_t i = 0; i < 3 * (size_t)nTriangles; i++)
+        newIndex[indices[i]] = 0;
+    uint32_t nVertices = 0;
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+        if (newIndex[v] == UINT32_MAX) continue;
+        newIndex[v] = nVertices;
+        vertices[nVertices++] = vertices[v];
+    }
+    for (size_t i = 0; i < 3 * (size_t)nTriangles; i++)
+        indices[i] = newIndex[indices[i]];
+
+    // spheres of no size, and spheres repeated with the same material
+    std::unordered_set<SphereKey, SphereKeyHash> seenSpheres;
+    size_t nSpheres = 0, nSphereDegenerate = 0, nSphereDuplicate = 0;
+    for (size_t s = 0; s < spheres.size(); s++)
+    {
+        const Sphere& sp = spheres[s];
+        if (sp.Radius == 0.0f)
+        {
+            nSphereDegenerate++;
+            continue;
+        }
+        SphereKey key;
+        memcpy(key.words, &sp.centerPosition[0], 3 * sizeof(float));
+        memcpy(key.words + 3, &sp.Radius, sizeof(float));
+        key.words[4] = sp.transform;
+        key.words[5] = sphereMaterial[s];
+        if (!seenSpheres.insert(key).second)
+        {
+            nSphereDuplicate++;
+            continue;
+        }
+        sphereMaterial[nSpheres] = sphereMaterial[s];
+        spheres[nSpheres++] = sp;
+    }
+    spheres.resize(nSpheres);
+    sphereMaterial.resize(nSpheres);
+
+    printf("Welded Vertices: %zu, Unused Vertices Removed: %zu\n", nWelded, (size_t)(numVertices - nVertices) - nWelded);
+    printf("Triangles Removed: %zu degenerate, %zu duplicate\n", nDegenerate, nDuplicate);
+    printf("Spheres Removed: %zu degenerate, %zu duplicate\n", nSphereDegenerate, nSphereDuplicate);
+
+    if (vertices == vertexStorage.data())
+    {
+        vertexStorage.resize(nVertices);
+        indexStorage.resize(3 * (size_t)nTriangles);
+        triangleMeshStorage.resize(nTriangles);
+    }
+    numVertices = nVertices;
+    numTriangles = nTriangles;
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("Geometry Cleanup Time: %lld ms\n\n",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+}
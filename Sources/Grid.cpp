@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <chrono>
+#include "Grid.hpp"
+
+GridAccel::GridAccel(const Geometry* geometry, std::vector<uint32_t> p)
+    : geometry(geometry), primitives(std::move(p))
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    nVoxels[0] = nVoxels[1] = nVoxels[2] = 1;
+    if (primitives.empty())
+        return;
+
+    std::vector<Bbox> primBounds;
+    primBounds.reserve(primitives.size());
+    for (uint32_t i = 0; i < primitives.size(); i++)
+    {
+        primBounds.push_back(geometry->bounds(primitives[i]));
+        bounds = i == 0 ? primBounds[0] : Union(bounds, primBounds[i]);
+    }
+
+    vec3 delta = bounds.Diagonal();
+    int maxAxis = bounds.maxExtent();
+    float voxelsPerUnitDist = delta[maxAxis] > 0.0f
+        ? 3.0f * std::pow((float)primitives.size(), 1.0f / 3.0f) / delta[maxAxis] : 0.0f;
+    for (int a = 0; a < 3; a++)
+    {
+        nVoxels[a] = std::max(1, std::min(maxVoxelsPerAxis, (int)std::round(delta[a] * voxelsPerUnitDist)));
+        width[a] = delta[a] / nVoxels[a];
+        invWidth[a] = width[a] > 0.0f ? 1.0f / width[a] : 0.0f;
+    }
+
+    // count the objects per voxel, then fill the compacted lists
+    size_t nCells = (size_t)nVoxels[0] * nVoxels[1] * nVoxels[2];
+    voxelStart.assign(nCells + 1, 0);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            for (size_t v = 0; v < nCells; v++)
+                voxelStart[v + 1] += voxelStart[v];
+            voxelPrims.resize(voxelStart[nCells]);
+        }
+        std::vector<uint32_t> fill(voxelStart.begin(), voxelStart.end() - 1);
+        for (uint32_t i = 0; i < primitives.size(); i++)
+        {
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = posToVoxel(primBounds[i].pMin, a);
+                hi[a] = posToVoxel(primBounds[i].pMax, a);
+            }
+            for (int z = lo[2]; z <= hi[2]; z++)
+                for (int y = lo[1]; y <= hi[1]; y++)
+                    for (int x = lo[0]; x <= hi[0]; x++)
+                    {
+                        if (pass == 0) voxelStart[offset(x, y, z) + 1]++;
+                        else voxelPrims[fill[offset(x, y, z)]++] = i;
+                    }
+        }
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("Grid Generation complete: %lld ms\n",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+    printf("Grid Voxels: %i x %i x %i, Object References: %zu\n\n", nVoxels[0], nVoxels[1], nVoxels[2], voxelPrims.size());
+}
+
+bool GridAccel::Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const
+{
+    hitDistance = std::numeric_limits<float>::max();
+    bool hit = false;
+
+    float rayT, rayExit;
+    if (primitives.empty() || !bounds.IntersectionP(ray, rayT, rayExit))
+        return false;
+    vec3 gridIntersect = ray.origin + rayT * ray.direction;
+
+    // DDA setup: voxel, parametric distance to the next boundary and step per axis
+    int pos[3], step[3], out[3];
+    float nextCrossingT[3], deltaT[3];
+    for (int a = 0; a < 3; a++)
+    {
+        pos[a] = posToVoxel(gridIntersect, a);
+        if (ray.direction[a] == 0.0f)
+        {
+            nextCrossingT[a] = std::numeric_limits<float>::max();
+            deltaT[a] = 0.0f;
+            step[a] = 0;
+            out[a] = -1;
+        }
+        else if (ray.direction[a] > 0.0f)
+        {
+            nextCrossingT[a] = rayT + (voxelToPos(pos[a] + 1, a) - gridIntersect[a]) / ray.direction[a];
+            deltaT[a] = width[a] / ray.direction[a];
+            step[a] = 1;
+            out[a] = nVoxels[a];
+        }
+        else
+        {
+            nextCrossingT[a] = rayT + (voxelToPos(pos[a], a) - gridIntersect[a]) / ray.direction[a];
+            deltaT[a] = -width[a] / ray.direction[a];
+            step[a] = -1;
+            out[a] = -1;
+        }
+    }
+
+    const int mailboxSize = 8;
+    uint32_t mailbox[mailboxSize];
+    std::fill(mailbox, mailbox + mailboxSize, 0xFFFFFFFFu);
+
+    while (true)
+    {
+        int voxel = offset(pos[0], pos[1], pos[2]);
+        for (uint32_t i = voxelStart[voxel]; i < voxelStart[voxel + 1]; i++)
+        {
+            uint32_t primNum = voxelPrims[i];
+            uint32_t& box = mailbox[primNum & (mailboxSize - 1)];
+            if (box == primNum) continue;
+            box = primNum;
+
+            PII isect = geometry->intersect(ray, primitives[primNum]);
+            if (isect.first && isect.second < hitDistance)
+            {
+                hitDistance = isect.second;
+                hitPrim = primitives[primNum];
+                hit = true;
+            }
+        }
+
+        // advance along the axis whose boundary comes first
+        int stepAxis = nextCrossingT[0] < nextCrossingT[1]
+            ? (nextCrossingT[0] < nextCrossingT[2] ? 0 : 2)
+            : (nextCrossingT[1] < nextCrossingT[2] ? 1 : 2);
+        if (hitDistance < nextCrossingT[stepAxis] || step[stepAxis] == 0) break;
+        pos[stepAxis] += step[stepAxis];
+        if (pos[stepAxis] == out[stepAxis]) break;
+        nextCrossingT[stepAxis] += deltaT[stepAxis];
+    }
+    return hit;
+}
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include "KdTree.hpp"
+
+struct KdTreeAccel::BoundEdge
+{
+    float t;
+    uint32_t primNum;
+    bool starting;
+
+    bool operator<(const BoundEdge& e) const
+    {
+        // at equal positions starting edges go first, so touching objects count on both sides
+        if (t == e.t) return starting && !e.starting;
+        return t < e.t;
+    }
+};
+
+KdTreeAccel::KdTreeAccel(const Geometry* geometry, std::vector<uint32_t> p, int isectCost, int traversalCost,
+    float emptyBonus, int maxPrims, int maxDepth)
+    : geometry(geometry), primitives(std::move(p)), isectCost(isectCost), traversalCost(traversalCost),
+    maxPrims(maxPrims), emptyBonus(emptyBonus)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    if (primitives.empty())
+        return;
+    if (maxDepth <= 0)
+        maxDepth = (int)std::round(8 + 1.3f * std::log2((float)primitives.size()));
+
+    std::vector<Bbox> primBounds;
+    primBounds.reserve(primitives.size());
+    std::vector<uint32_t> primNums(primitives.size());
+    for (uint32_t i = 0; i < primitives.size(); i++)
+    {
+        primBounds.push_back(geometry->bounds(primitives[i]));
+        bounds = i == 0 ? primBounds[0] : Union(bounds, primBounds[i]);
+        primNums[i] = i;
+    }
+
+    std::vector<BoundEdge> edges[3];
+    buildTree(bounds, primBounds, primNums, maxDepth, edges, 0);
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("kd-tree Generation complete: %lld ms\n",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+    printf("kd-tree Nodes: %zu, Object References: %zu\n\n", nodes.size(), primIndices.size());
+}
+
+void KdTreeAccel::buildTree(const Bbox& nodeBounds, const std::vector<Bbox>& allPrimBounds, const std::vector<uint32_t>& primNums,
+    int depth, std::vector<BoundEdge> edges[3], int badRefines)
+{
+    uint32_t nodeNum = (uint32_t)nodes.size();
+    nodes.emplace_back();
+    uint32_t nPrimitives = (uint32_t)primNums.size();
+    float totalSA = nodeBounds.SurfaceArea();
+    if (nPrimitives <= (uint32_t)maxPrims || depth == 0 || totalSA <= 0.0f)
+    {
+        nodes[nodeNum].initLeaf((uint32_t)primIndices.size(), nPrimitives);
+        primIndices.insert(primIndices.end(), primNums.begin(), primNums.end());
+        return;
+    }
+
+    // SAH over the bounds edges of the longest axis, falling back to the other two
+    int bestAxis = -1, bestOffset = -1;
+    float bestCost = std::numeric_limits<float>::max();
+    float oldCost = (float)isectCost * nPrimitives;
+    float invTotalSA = 1.0f / totalSA;
+    vec3 d = nodeBounds.Diagonal();
+    int axis = nodeBounds.maxExtent();
+    for (int retries = 0; retries < 3 && bestAxis == -1; retries++, axis = (axis + 1) % 3)
+    {
+        edges[axis].resize(2 * nPrimitives);
+        for (uint32_t i = 0; i < nPrimitives; i++)
+        {
+            const Bbox& b = allPrimBounds[primNums[i]];
+            edges[axis][2 * i] = { b.pMin[axis], primNums[i], true };
+            edges[axis][2 * i + 1] = { b.pMax[axis], primNums[i], false };
+        }
+        std::sort(edges[axis].begin(), edges[axis].end());
+
+        uint32_t nBelow = 0, nAbove = nPrimitives;
+        for (uint32_t i = 0; i < 2 * nPrimitives; i++)
+        {
+            if (!edges[axis][i].starting) --nAbove;
+            float edgeT = edges[axis][i].t;
+            if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis])
+            {
+                int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+                float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] + (edgeT - nodeBounds.pMin[axis]) * (d[otherAxis0] + d[otherAxis1]));
+                float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] + (nodeBounds.pMax[axis] - edgeT) * (d[otherAxis0] + d[otherAxis1]));
+                float pBelow = belowSA * invTotalSA;
+                float pAbove = aboveSA * invTotalSA;
+                float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0.0f;
+                float cost = traversalCost + isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = (int)i;
+                }
+            }
+            if (edges[axis][i].starting) ++nBelow;
+        }
+    }
+
+    if (bestCost > oldCost) ++badRefines;
+    if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 || badRefines == 3)
+    {
+        nodes[nodeNum].initLeaf((uint32_t)primIndices.size(), nPrimitives);
+        primIndices.insert(primIndices.end(), primNums.begin(), primNums.end());
+        return;
+    }
+
+    std::vector<uint32_t> prims0, prims1;
+    for (int i = 0; i < bestOffset; i++)
+        if (edges[bestAxis][i].starting) prims0.push_back(edges[bestAxis][i].primNum);
+    for (uint32_t i = bestOffset + 1; i < 2 * nPrimitives; i++)
+        if (!edges[bestAxis][i].starting) prims1.push_back(edges[bestAxis][i].primNum);
+
+    float tSplit = edges[bestAxis][bestOffset].t;
+    Bbox bounds0 = nodeBounds, bounds1 = nodeBounds;
+    bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
+
+    buildTree(bounds0, allPrimBounds, prims0, depth - 1, edges, badRefines);
+    uint32_t aboveChild = (uint32_t)nodes.size();
+    nodes[nodeNum].initInterior(bestAxis, aboveChild, tSplit);
+    buildTree(bounds1, allPrimBounds, prims1, depth - 1, edges, badRefines);
+}
+
+bool KdTreeAccel::Intersect(const Ray& ray, float& hitDistance, uint32_t& hitPrim) const
+{
+    hitDistance = std::numeric_limits<float>::max();
+    bool hit = false;
+
+    float tMin, tMax;
+    if (nodes.empty() || !bounds.IntersectionP(ray, tMin, tMax))
+        return false;
+
+    vec3 invDir;
+    for (int a = 0; a < 3; a++)
+        invDir[a] = ray.direction[a] != 0.0f ? 1.0f / ray.direction[a] : 0.0f;
+
+    struct KdToDo { const KdTreeNode* node; float tMin, tMax; };
+    KdToDo toDo[64];
+    int toDoPos = 0;
+
+    // direct mapped mailbox: objects referenced by several leaves are tested once per ray
+    const int mailboxSize = 8;
+    uint32_t mailbox[mailboxSize];
+    std::fill(mailbox, mailbox + mailboxSize, 0xFFFFFFFFu);
+
+    const KdTreeNode* node = &nodes[0];
+    while (node != nullptr)
+    {
+        if (hitDistance < tMin) break;
+        if (!node->isLeaf())
+        {
+            int axis = node->splitAxis();
+            float tPlane = ray.direction[axis] != 0.0f ? (node->split - ray.origin[axis]) * invDir[axis]
+                : std::numeric_limits<float>::max();
+
+            bool belowFirst = (ray.origin[axis] < node->split) ||
+                (ray.origin[axis] == node->split && ray.direction[axis] <= 0);
+            const KdTreeNode* firstChild = belowFirst ? node + 1 : &nodes[node->aboveChild()];
+            const KdTreeNode* secondChild = belowFirst ? &nodes[node->aboveChild()] : node + 1;
+
+            if (tPlane > tMax || tPlane <= 0)
+                node = firstChild;
+            else if (tPlane < tMin)
+                node = secondChild;
+            else
+            {
+                toDo[toDoPos++] = { secondChild, tPlane, tMax };
+                node = firstChild;
+                tMax = tPlane;
+            }
+        }
+        else
+        {
+            for (uint32_t i = 0; i < node->nPrimitives(); i++)
+            {
+                uint32_t primNum = primIndices[node->primOffset + i];
+                uint32_t& box = mailbox[primNum & (mailboxSize - 1)];
+                if (box == primNum) continue;
+                box = primNum;
+
+                PII isect = geometry->intersect(ray, primitives[primNum]);
+                if (isect.first && isect.second < hitDistance)
+                {
+                    hitDistance = isect.second;
+                    hitPrim = primitives[primNum];
+                    hit = true;
+                }
+            }
+
+            if (toDoPos > 0)
+            {
+                --toDoPos;
+                node = toDo[toDoPos].node;
+                tMin = toDo[toDoPos].tMin;
+                tMax = toDo[toDoPos].tMax;
+            }
+            else
+                break;
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,106 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+bool MappedFile::open(const char* filename, bool copyOnWrite)
+{
+    close();
+    HANDLE f = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(f, &fileSize))
+    {
+        CloseHandle(f);
+        return false;
+    }
+    file = f;
+    opened = true;
+    length = (size_t)fileSize.QuadPart;
+    if (length == 0) return true; // empty files cannot be mapped
+
+    mapping = CreateFileMappingA(f, nullptr, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr)
+        view = MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    if (view == nullptr)
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (view != nullptr) UnmapViewOfFile(view);
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != nullptr) CloseHandle(file);
+    view = mapping = file = nullptr;
+    length = 0;
+    opened = false;
+}
+
+void MappedFile::adviseRandom()
+{
+}
+
+void MappedFile::discard(size_t offset, size_t size)
+{
+    // unlocking pages that are not locked takes them out of the working set
+    if (view != nullptr && size > 0) VirtualUnlock((char*)view + offset, size);
+}
+
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool MappedFile::open(const char* filename, bool copyOnWrite)
+{
+    close();
+    fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close();
+        return false;
+    }
+    opened = true;
+    length = (size_t)st.st_size;
+    if (length == 0) return true; // empty files cannot be mapped
+
+    void* p = mmap(nullptr, length, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    view = p;
+    madvise(view, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (view != nullptr) munmap(view, length);
+    if (fd >= 0) ::close(fd);
+    view = nullptr;
+    fd = -1;
+    length = 0;
+    opened = false;
+}
+
+void MappedFile::adviseRandom()
+{
+    if (view != nullptr) madvise(view, length, MADV_RANDOM);
+}
+
+void MappedFile::discard(size_t offset, size_t size)
+{
+    if (view != nullptr && size > 0) madvise((char*)view + offset, size, MADV_DONTNEED);
+}
+#endif
@@ -0,0 +1,373 @@
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include "MeshLoader.hpp"
+#include "MappedFile.hpp"
+#include "Tokenizer.hpp"
+#include "ThreadPool.hpp"
+
+static bool endsWith(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    if (s.size() < n) return false;
+    for (size_t i = 0; i < n; i++)
+        if (tolower((unsigned char)s[s.size() - n + i]) != suffix[i]) return false;
+    return true;
+}
+
+/*---------------------------------------------------------- OBJ ----------------------------------------------------------*/
+static bool loadOBJ(const MappedFile& file, const char* filename, std::vector<vec3>& vertices, std::vector<uint32_t>& indices)
+{
+    const size_t base = vertices.size();
+    size_t lineNumber = 0;
+    for (const char* line = file.data(); line < file.end(); )
+    {
+        const char* eol = lineEnd(line, file.end());
+        Tokenizer s(line, eol);
+        line = eol + 1;
+        lineNumber++;
+        if (s.empty() || *s.p == '#') continue;
+        std::string_view cmd = s.word();
+
+        if (cmd == "v")
+        {
+            float v[3];
+            if (!s.readvals(3, v))
+            {
+                std::cerr << "Failed reading vertex in " << filename << " line " << lineNumber << "\n";
+                return false;
+            }
+            vertices.push_back(vec3(v[0], v[1], v[2]));
+        }
+        else if (cmd == "f")
+        {
+            // corners are v, v/vt, v//vn or v/vt/vn, negative v counts back from the last vertex
+            long long first = 0, prev = 0;
+            int corner = 0;
+            for (std::string_view word = s.word(); !word.empty(); word = s.word(), corner++)
+            {
+                long long v;
+                std::from_chars_result r = std::from_chars(word.data(), word.data() + word.size(), v);
+                if (r.ec != std::errc() || v == 0)
+                {
+                    std::cerr << "Failed reading face in " << filename << " line " << lineNumber << "\n";
+                    return false;
+                }
+                v = v < 0 ? (long long)(vertices.size() - base) + v : v - 1;
+                if (v < 0 || (unsigned long long)v >= vertices.size() - base)
+                {
+                    std::cerr << "Face of " << filename << " line " << lineNumber << " uses a vertex that does not exist\n";
+                    return false;
+                }
+                if (corner == 0) first = v;
+                if (corner >= 2)
+                {
+                    indices.push_back((uint32_t)(base + first));
+                    indices.push_back((uint32_t)(base + prev));
+                    indices.push_back((uint32_t)(base + v));
+                }
+                prev = v;
+            }
+        }
+        // groups, materials, normals and texture coordinates are not used
+    }
+
+    return true;
+}
+
+/*---------------------------------------------------------- PLY ----------------------------------------------------------*/
+enum PlyType { PlyInt8, PlyUInt8, PlyInt16, PlyUInt16, PlyInt32, PlyUInt32, PlyFloat32, PlyFloat64, PlyInvalid };
+
+static const int plyTypeSize[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static PlyType plyType(std::string_view name)
+{
+    if (name == "char" || name == "int8") return PlyInt8;
+    if (name == "uchar" || name == "uint8") return PlyUInt8;
+    if (name == "short" || name == "int16") return PlyInt16;
+    if (name == "ushort" || name == "uint16") return PlyUInt16;
+    if (name == "int" || name == "int32") return PlyInt32;
+    if (name == "uint" || name == "uint32") return PlyUInt32;
+    if (name == "float" || name == "float32") return PlyFloat32;
+    if (name == "double" || name == "float64") return PlyFloat64;
+    return PlyInvalid;
+}
+
+struct PlyProperty
+{
+    std::string name;
+    PlyType type;
+    PlyType countType; // PlyInvalid unless this is a list
+};
+
+struct PlyElement
+{
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+static double readPlyValue(const char* p, PlyType type, bool swapBytes)
+{
+    unsigned char bytes[8];
+    int size = plyTypeSize[type];
+    for (int i = 0; i < size; i++)
+        bytes[i] = (unsigned char)p[swapBytes ? size - 1 - i : i];
+    switch (type)
+    {
+    case PlyInt8: { int8_t v; memcpy(&v, bytes, 1); return v; }
+    case PlyUInt8: { uint8_t v; memcpy(&v, bytes, 1); return v; }
+    case PlyInt16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+    case PlyUInt16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+    case PlyInt32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+    case PlyUInt32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+    case PlyFloat32: { float v; memcpy(&v, bytes, 4); return v; }
+    default: { double v; memcpy(&v, bytes, 8); return v; }
+    }
+}
+
+// size of one record of element, walking its lists; 0 if it runs past end
+static size_t plyRecordSize(const PlyElement& element, const char* p, const char* end, bool swapBytes)
+{
+    size_t size = 0;
+    for (const PlyProperty& prop : element.properties)
+    {
+        if (prop.countType == PlyInvalid)
+        {
+            size += plyTypeSize[prop.type];
+            continue;
+        }
+        if (p + size + plyTypeSize[prop.countType] > end) return 0;
+        double count = readPlyValue(p + size, prop.countType, swapBytes);
+        if (count < 0) return 0;
+        size += plyTypeSize[prop.countType] + (size_t)count * plyTypeSize[prop.type];
+    }
+    return p + size <= end ? size : 0;
+}
+
+static bool loadPLY(const MappedFile& file, const char* filename, std::vector<vec3>& vertices, std::vector<uint32_t>& indices)
+{
+    // header, one keyword line at a time up to end_header
+    std::vector<PlyElement> elements;
+    bool binary = false, swapBytes = false;
+    const char* line = file.data();
+    const char* data = nullptr;
+    bool first = true;
+    while (line < file.end() && data == nullptr)
+    {
+        const char* eol = lineEnd(line, file.end());
+        Tokenizer s(line, eol);
+        line = eol + 1;
+        std::string_view keyword = s.word();
+        if (first)
+        {
+            if (keyword != "ply") break;
+            first = false;
+        }
+        else if (keyword == "format")
+        {
+            std::string_view format = s.word();
+            binary = format == "binary_little_endian" || format == "binary_big_endian";
+            uint16_t one = 1;
+            bool littleEndianHost = *(const char*)&one == 1;
+            swapBytes = (format == "binary_big_endian") == littleEndianHost;
+        }
+        else if (keyword == "element")
+        {
+            PlyElement element;
+            element.name = std::string(s.word());
+            long long count;
+            if (!s.readInt(count) || count < 0) break;
+            element.count = (size_t)count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            PlyProperty prop;
+            std::string_view type = s.word();
+            prop.countType = PlyInvalid;
+            if (type == "list")
+            {
+                prop.countType = plyType(s.word());
+                type = s.word();
+                if (prop.countType == PlyInvalid || prop.countType == PlyFloat32 || prop.countType == PlyFloat64) break;
+            }
+            prop.type = plyType(type);
+            prop.name = std::string(s.word());
+            if (prop.type == PlyInvalid) break;
+            elements.back().properties.push_back(prop);
+        }
+        else if (keyword == "end_header") data = line;
+    }
+    if (data == nullptr)
+    {
+        std::cerr << "Failed reading PLY header of " << filename << "\n";
+        return false;
+    }
+    if (!binary)
+    {
+        std::cerr << "Only binary PLY is supported, " << filename << " is ASCII\n";
+        return false;
+    }
+
+    const size_t base = vertices.size();
+    size_t nVertices = 0;
+    const char* p = std::min(data, file.end());
+    for (const PlyElement& element : elements)
+    {
+        bool fixedSize = true;
+        size_t stride = 0;
+        for (const PlyProperty& prop : element.properties)
+        {
+            fixedSize = fixedSize && prop.countType == PlyInvalid;
+            stride += plyTypeSize[prop.type];
+        }
+
+        if (element.name == "vertex")
+        {
+            int xyz[3] = { -1, -1, -1 };
+            size_t offsets[3] = { 0, 0, 0 }, offset = 0;
+            for (size_t i = 0; i < element.properties.size(); i++)
+            {
+                const std::string& name = element.properties[i].name;
+                int axis = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 : -1;
+                if (axis >= 0)
+                {
+                    xyz[axis] = (int)i;
+                    offsets[axis] = offset;
+                }
+                offset += plyTypeSize[element.properties[i].type];
+            }
+            if (!fixedSize || xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0
+                || (size_t)(file.end() - p) / stride < element.count)
+            {
+                std::cerr << "Failed reading PLY vertices of " << filename << "\n";
+                return false;
+            }
+
+            // fixed stride, so every vertex can be converted independently
+            vertices.resize(base + element.count);
+            PlyType types[3] = { element.properties[xyz[0]].type, element.properties[xyz[1]].type, element.properties[xyz[2]].type };
+            const char* records = p;
+            ThreadPool::global().parallelFor(element.count, 16384, [&](size_t begin, size_t end) {
+                for (size_t v = begin; v < end; v++)
+                {
+                    const char* record = records + v * stride;
+                    for (int a = 0; a < 3; a++)
+                        vertices[base + v][a] = (float)readPlyValue(record + offsets[a], types[a], swapBytes);
+                }
+            });
+            nVertices = element.count;
+            p += element.count * stride;
+        }
+        else if (element.name == "face")
+        {
+            int list = -1;
+            for (size_t i = 0; i < element.properties.size(); i++)
+                if (element.properties[i].countType != PlyInvalid
+                    && (element.properties[i].name == "vertex_indices" || element.properties[i].name == "vertex_index"))
+                    list = (int)i;
+            if (list < 0)
+            {
+                std::cerr << "PLY faces of " << filename << " have no vertex_indices\n";
+                return false;
+            }
+
+            // every face takes at least its list counts and fixed properties, which bounds the count
+            size_t minRecordSize = 0;
+            for (const PlyProperty& prop : element.properties)
+                minRecordSize += plyTypeSize[prop.countType == PlyInvalid ? prop.type : prop.countType];
+            if ((size_t)(file.end() - p) / minRecordSize < element.count)
+            {
+                std::cerr << "PLY faces of " << filename << " are truncated\n";
+                return false;
+            }
+            indices.reserve(indices.size() + 3 * element.count);
+            for (size_t f = 0; f < element.count; f++)
+            {
+                size_t recordSize = plyRecordSize(element, p, file.end(), swapBytes);
+                if (recordSize == 0)
+                {
+                    std::cerr << "PLY faces of " << filename << " are truncated\n";
+                    return false;
+                }
+                const char* q = p;
+                for (int i = 0; i < list; i++)
+                {
+                    const PlyProperty& prop = element.properties[i];
+                    q += prop.countType == PlyInvalid ? plyTypeSize[prop.type]
+                        : plyTypeSize[prop.countType] + (size_t)readPlyValue(q, prop.countType, swapBytes) * plyTypeSize[prop.type];
+                }
+                const PlyProperty& prop = element.properties[list];
+                size_t corners = (size_t)readPlyValue(q, prop.countType, swapBytes);
+                q += plyTypeSize[prop.countType];
+                double firstCorner = corners > 0 ? readPlyValue(q, prop.type, swapBytes) : 0, prev = 0;
+                for (size_t c = 0; c < corners; c++, q += plyTypeSize[prop.type])
+                {
+                    double v = readPlyValue(q, prop.type, swapBytes);
+                    if (v < 0 || v >= nVertices)
+                    {
+                        std::cerr << "Face of " << filename << " uses a vertex that does not exist\n";
+                        return false;
+                    }
+                    if (c >= 2)
+                    {
+                        indices.push_back((uint32_t)(base + (size_t)firstCorner));
+                        indices.push_back((uint32_t)(base + (size_t)prev));
+                        indices.push_back((uint32_t)(base + (size_t)v));
+                    }
+                    prev = v;
+                }
+                p += recordSize;
+            }
+        }
+        else
+        {
+            // skip other elements
+            for (size_t i = 0; i < element.count; i++)
+            {
+                size_t recordSize = fixedSize ? stride : plyRecordSize(element, p, file.end(), swapBytes);
+                if (recordSize == 0 || (size_t)(file.end() - p) < recordSize)
+                {
+                    std::cerr << "PLY element " << element.name << " of " << filename << " is truncated\n";
+                    return false;
+                }
+                p += recordSize;
+            }
+        }
+    }
+    return true;
+}
+
+bool loadMesh(const char* filename, std::vector<vec3>& vertices, std::vector<uint32_t>& indices)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        std::cerr << "Unable to Open Mesh File " << filename << "\n";
+        return false;
+    }
+
+    size_t firstVertex = vertices.size(), firstIndex = indices.size();
+    bool ok;
+    if (endsWith(filename, ".ply")) ok = loadPLY(file, filename, vertices, indices);
+    else if (endsWith(filename, ".obj")) ok = loadOBJ(file, filename, vertices, indices);
+    else
+    {
+        std::cerr << "Unknown Mesh Format " << filename << ", expected .obj or .ply\n";
+        ok = false;
+    }
+    if (ok && vertices.size() > UINT32_MAX)
+    {
+        std::cerr << "Mesh " << filename << " has more vertices than 32-bit indices can address\n";
+        ok = false;
+    }
+    // leave nothing of a file that failed half way
+    if (!ok)
+    {
+        vertices.resize(firstVertex);
+        indices.resize(firstIndex);
+    }
+    return ok;
+}
@@ -0,0 +1,80 @@
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include "PageCache.hpp"
+
+const size_t chunkSize = (size_t)1 << PageCache::ChunkShift;
+
+PageCache::PageCache(MappedFile& file, size_t budgetBytes) : file(file)
+{
+    nChunks = (file.size() + chunkSize - 1) / chunkSize;
+    budgetChunks = std::max<size_t>(1, budgetBytes / chunkSize);
+    lastUse.reset(new std::atomic<uint32_t>[nChunks]);
+    resident.reset(new std::atomic<bool>[nChunks]);
+    for (size_t c = 0; c < nChunks; c++)
+    {
+        lastUse[c] = 0;
+        resident[c] = false;
+    }
+    // start from nothing resident: loading read the tables and checked the indices
+    file.adviseRandom();
+    file.discard(0, file.size());
+}
+
+void PageCache::loaded(size_t chunk)
+{
+    chunkLoads.fetch_add(1, std::memory_order_relaxed);
+    residentChunks.fetch_add(1, std::memory_order_relaxed);
+    // a second chance for the chunks read since the hand passed, two sweeps find a victim
+    // unless the other threads keep reading them, then the next load tries again
+    for (size_t step = 0; residentChunks.load(std::memory_order_relaxed) > budgetChunks && step < 2 * nChunks; step++)
+    {
+        size_t c = hand.fetch_add(1, std::memory_order_relaxed) % nChunks;
+        if (c == chunk || !resident[c].load(std::memory_order_relaxed)) continue;
+        if (lastUse[c].exchange(0, std::memory_order_relaxed) != 0) continue;
+        if (!resident[c].exchange(false, std::memory_order_relaxed)) continue;
+        residentChunks.fetch_sub(1, std::memory_order_relaxed);
+        file.discard(c * chunkSize, std::min(chunkSize, file.size() - c * chunkSize));
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t residentNow = residentChunks.load(std::memory_order_relaxed);
+    size_t peak = peakChunks.load(std::memory_order_relaxed);
+    while (residentNow > peak && !peakChunks.compare_exchange_weak(peak, residentNow, std::memory_order_relaxed)) {}
+}
+
+void PageCache::collect()
+{
+    std::lock_guard<std::mutex> lock(collecting);
+    uint32_t now = clock.load();
+    size_t residentNow = residentChunks.load();
+    if (residentNow > budgetChunks)
+    {
+        // chunks of the current clock may be in use right now, they stay
+        std::vector<std::pair<uint32_t, size_t>> candidates;
+        for (size_t c = 0; c < nChunks; c++)
+        {
+            uint32_t used = lastUse[c].load(std::memory_order_relaxed);
+            if (resident[c].load(std::memory_order_relaxed) && used != now)
+                candidates.push_back({ used, c });
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        size_t target = budgetChunks * 3 / 4;
+        for (size_t i = 0; i < candidates.size() && residentChunks.load() > target; i++)
+        {
+            size_t c = candidates[i].second;
+            if (!resident[c].exchange(false)) continue;
+            residentChunks.fetch_sub(1);
+            file.discard(c * chunkSize, std::min(chunkSize, file.size() - c * chunkSize));
+            evictions++;
+        }
+    }
+    clock.store(now + 1);
+}
+
+void PageCache::printStats() const
+{
+    printf("Geometry Paging: budget %.1f MB, peak resident %.1f MB, %llu chunk loads, %llu evictions\n",
+        budgetChunks * (double)chunkSize / (1 << 20), peakChunks.load() * (double)chunkSize / (1 << 20),
+        (unsigned long long)chunkLoads.load(), (unsigned long long)evictions.load());
+}
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include "RayQuery.hpp"
+#include "ThreadPool.hpp"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+const int PacketSize = 32; // one bit of a mask per ray
+const size_t QueryGrain = 1024;
+
+// a query ray with what its box tests need, and its result so far
+struct PacketRay
+{
+    Ray ray = Ray(vec3(0.0f), vec3(0.0f));
+    vec3 invDir;
+    std::array<int, 3> dirIsNeg;
+    float hitDistance;
+    uint32_t hitPrim;
+    bool anyHit;
+};
+
+static inline int lowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static int octant(const RayQuery& q)
+{
+    return (q.direction[0] > 0 ? 0 : 1) | (q.direction[1] > 0 ? 0 : 2) | (q.direction[2] > 0 ? 0 : 4);
+}
+
+// true when an any-hit ray is done
+static inline bool intersectLeaf(const BVHAccel* bvh, uint32_t first, uint32_t count, PacketRay& r)
+{
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        PII hit = bvh->geometry->intersect(r.ray, bvh->primitives[i]);
+        if (hit.first && hit.second < r.hitDistance)
+        {
+            r.hitDistance = hit.second;
+            r.hitPrim = bvh->primitives[i];
+            if (r.anyHit) return true;
+        }
+    }
+    return false;
+}
+
+// The stack traversal with a mask of the rays still in each subtree: a child's box is
+// decoded once and tested against every ray of the mask, and entered when one of them
+// hits it. The near child of the packet's octant is visited first, so each ray visits
+// its nodes in the order it would alone, and a ray's closest hit so far culls boxes
+// for it only. Any-hit rays leave the packet at their first hit.
+void BVHAccel::intersectPacket(PacketRay* rays, int n) const
+{
+    uint32_t active = 0;
+    for (int i = 0; i < n; i++)
+        if (bounds.IntersectionP(rays[i].ray, rays[i].invDir, rays[i].dirIsNeg, rays[i].hitDistance))
+            active |= 1u << i;
+    if (active == 0 || primitives.empty()) return;
+
+    if (nodeCount == 0)
+    {
+        for (int i = 0; i < n; i++)
+            if (active & (1u << i)) intersectLeaf(this, 0, (uint32_t)primitives.size(), rays[i]);
+        return;
+    }
+
+    struct Entry { uint32_t node, mask; };
+    Entry toVisit[MaxDepth];
+    int toVisitOffset = 0;
+    uint32_t current = 0, mask = active, finished = 0;
+    const std::array<int, 3>& dirIsNeg = rays[0].dirIsNeg;
+    while (true)
+    {
+        const CompressedBVHNode& node = nodeArray[current];
+        if (geometry->pageCache != nullptr) geometry->pageCache->touch(&node);
+        uint32_t hit[2] = { 0, 0 };
+        for (int c = 0; c < 2; c++)
+        {
+            Bbox box = node.childBounds(c);
+            for (uint32_t m = mask; m != 0; m &= m - 1)
+            {
+                PacketRay& r = rays[lowestBit(m)];
+                if (box.IntersectionP(r.ray, r.invDir, r.dirIsNeg, r.hitDistance)) hit[c] |= m & (0u - m);
+            }
+        }
+
+        int first = dirIsNeg[node.splitAxis];
+        Entry next = { 0, 0 };
+        for (int k = 0; k < 2; k++)
+        {
+            int c = k == 0 ? first : 1 - first;
+            if (hit[c] == 0) continue;
+            if (node.isLeaf(c))
+            {
+                for (uint32_t m = hit[c]; m != 0; m &= m - 1)
+                    if (intersectLeaf(this, node.leafPrimOffset(c), node.leafPrimCount(c), rays[lowestBit(m)]))
+                        finished |= m & (0u - m);
+            }
+            else if (next.mask == 0)
+                next = { node.child[c], hit[c] };
+            else
+                toVisit[toVisitOffset++] = { node.child[c], hit[c] };
+        }
+
+        next.mask &= ~finished;
+        while (next.mask == 0 && toVisitOffset > 0)
+        {
+            next = toVisit[--toVisitOffset];
+            next.mask &= ~finished;
+        }
+        if (next.mask == 0) break;
+        current = next.node;
+        mask = next.mask;
+    }
+}
+
+static void setup(const RayQuery& q, PacketRay& r)
+{
+    r.ray = Ray(vec3(q.origin[0], q.origin[1], q.origin[2]), vec3(q.direction[0], q.direction[1], q.direction[2]));
+    for (int a = 0; a < 3; a++)
+    {
+        r.invDir[a] = q.direction[a] != 0.0f ? 1.0f / q.direction[a] : 0.0f;
+        r.dirIsNeg[a] = q.direction[a] > 0 ? 0 : 1;
+    }
+    r.hitDistance = q.tMax;
+    r.anyHit = (q.flags & RayQuery::AnyHit) != 0;
+}
+
+static RayHit result(const Geometry& geometry, float t, uint32_t prim, bool hit)
+{
+    if (!hit) return { 0.0f, RayHit::Miss, RayHit::Miss };
+    return { t, prim, (uint32_t)(&geometry.material(prim) - geometry.materials.data()) };
+}
+
+void traceRays(const Scene& scene, const RayQuery* rays, RayHit* hits, size_t count)
+{
+    const Geometry& geometry = *scene.geometry;
+    const BVHAccel* bvh = dynamic_cast<const BVHAccel*>(scene.accelerator);
+    ThreadPool::global().parallelFor(count, QueryGrain, [&](size_t begin, size_t end) {
+        if (bvh == nullptr)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                float t;
+                uint32_t prim;
+                Ray ray(vec3(rays[i].origin[0], rays[i].origin[1], rays[i].origin[2]),
+                    vec3(rays[i].direction[0], rays[i].direction[1], rays[i].direction[2]));
+                bool hit = scene.accelerator->Intersect(ray, t, prim) && t < rays[i].tMax;
+                hits[i] = result(geometry, t, prim, hit);
+            }
+            return;
+        }
+
+        // the rays of the chunk by octant, each in its given order
+        std::vector<uint32_t> order(end - begin);
+        size_t start[9] = {};
+        for (size_t i = begin; i < end; i++)
+            start[octant(rays[i]) + 1]++;
+        for (int o = 0; o < 8; o++)
+            start[o + 1] += start[o];
+        for (size_t i = begin; i < end; i++)
+            order[start[octant(rays[i])]++] = (uint32_t)i;
+
+        PacketRay packet[PacketSize];
+        for (size_t p = 0; p < order.size();)
+        {
+            int n = 0;
+            int o = octant(rays[order[p]]);
+            while (n < PacketSize && p + n < order.size() && octant(rays[order[p + n]]) == o)
+            {
+                setup(rays[order[p + n]], packet[n]);
+                packet[n].hitPrim = RayHit::Miss;
+                n++;
+            }
+            bvh->intersectPacket(packet, n);
+            for (int k = 0; k < n; k++)
+                hits[order[p + k]] = result(geometry, packet[k].hitDistance, packet[k].hitPrim, packet[k].hitPrim != RayHit::Miss);
+            p += n;
+        }
+    });
+}
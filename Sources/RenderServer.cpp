@@ -0,0 +1,326 @@
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include "RenderServer.hpp"
+#include "Tokenizer.hpp"
+#include "RayQuery.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET Socket;
+static const Socket invalidSocket = INVALID_SOCKET;
+static void closeSocket(Socket s) { closesocket(s); }
+static void removeSocketFile(const char* path) { DeleteFileA(path); }
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+typedef int Socket;
+static const Socket invalidSocket = -1;
+static void closeSocket(Socket s) { close(s); }
+static void removeSocketFile(const char* path) { unlink(path); }
+#endif
+
+// one client: request lines in, replies out
+class Connection
+{
+public:
+    explicit Connection(Socket s) : s(s) {}
+
+    bool readLine(std::string& line)
+    {
+        while (true)
+        {
+            size_t nl = buffer.find('\n');
+            if (nl != std::string::npos)
+            {
+                line = buffer.substr(0, nl);
+                buffer.erase(0, nl + 1);
+                return true;
+            }
+            char chunk[4096];
+            int n = (int)recv(s, chunk, sizeof(chunk), 0);
+            if (n <= 0) return false;
+            buffer.append(chunk, n);
+        }
+    }
+
+    bool read(void* data, size_t size)
+    {
+        char* p = (char*)data;
+        size_t buffered = std::min(size, buffer.size());
+        memcpy(p, buffer.data(), buffered);
+        buffer.erase(0, buffered);
+        for (size_t done = buffered; done < size;)
+        {
+            int n = (int)recv(s, p + done, (int)std::min<size_t>(size - done, 1 << 20), 0);
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // false once the client is gone, what follows is dropped
+    bool write(const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+        while (!broken && size > 0)
+        {
+            int n = (int)send(s, p, (int)std::min<size_t>(size, 1 << 20), 0);
+            if (n <= 0) broken = true;
+            else p += n, size -= n;
+        }
+        return !broken;
+    }
+
+    bool writeLine(const std::string& line) { return write((line + "\n").data(), line.size() + 1); }
+
+    std::mutex writing; // tiles are sent from the tracing threads
+
+private:
+    Socket s;
+    std::string buffer;
+    bool broken = false;
+};
+
+const double MaxPixels = (double)(1 << 28); // 3 bytes each, the film's buffer size is an int
+const size_t TraceChunk = 1 << 16; // rays read at a time
+
+// render <id> [view i] [camera 10 values] [size w h] [region x0 y0 x1 y1] [aa n]
+// [aa-threshold t] [time-budget s]: image line, a tile line and its pixels for each
+// finished tile, done line
+static void render(Connection& client, Job& job, Tokenizer& args, Options options)
+{
+    View view = job.views[0];
+    int w = job.scene.w, h = job.scene.h;
+    float region[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    bool wholeImage = true;
+    for (std::string_view key = args.word(); !key.empty(); key = args.word())
+    {
+        float values[10];
+        long long n;
+        bool valid = true;
+        if (key == "view" && (valid = args.readInt(n)) && n >= 0 && n < (long long)job.views.size()) view = job.views[(size_t)n];
+        else if (key == "camera" && (valid = args.readvals(10, values))) view = cameraView(values);
+        else if (key == "size" && (valid = args.readvals(2, values) && values[0] >= 1.0f && values[1] >= 1.0f
+            && values[0] <= MaxPixels && values[1] <= MaxPixels)) w = (int)values[0], h = (int)values[1];
+        else if (key == "region" && (valid = args.readvals(4, values))) std::copy(values, values + 4, region), wholeImage = false;
+        else if (key == "aa" && (valid = args.readInt(n))) options.aaMaxSamples = std::max(1, (int)n);
+        else if (key == "aa-threshold" && (valid = args.readFloat(values[0]))) options.aaThreshold = values[0];
+        else if (key == "time-budget" && (valid = args.readFloat(values[0]))) options.timeBudget = values[0], options.progressive = true;
+        else valid = false;
+        if (!valid)
+        {
+            client.writeLine("error bad render argument " + std::string(key));
+            return;
+        }
+    }
+    if ((double)w * h > MaxPixels)
+    {
+        client.writeLine("error size above " + std::to_string((long long)MaxPixels) + " pixels");
+        return;
+    }
+    // clipped to the image before the float to int conversion
+    auto clip = [](float v, int size) { return (int)std::max(0.0f, std::min(v, (float)size)); };
+    Tile clipped = { 0, 0, w, h };
+    if (!wholeImage) clipped = { clip(region[0], w), clip(region[1], h), clip(region[2], w), clip(region[3], h) };
+    if (clipped.x1 <= clipped.x0 || clipped.y1 <= clipped.y0)
+    {
+        client.writeLine("error empty region");
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Camera camera(view.eye, view.center, view.up, view.fovy, w, h);
+    Film film = Film(w, h);
+    options.previewInterval = 0.0f;
+    applyOptions(film, options);
+    film.setRegion(clipped);
+    client.writeLine("image " + std::to_string(w) + " " + std::to_string(h) + " " + std::to_string(clipped.x0) + " "
+        + std::to_string(clipped.y0) + " " + std::to_string(clipped.x1) + " " + std::to_string(clipped.y1));
+    film.setTileCallback([&](const Tile& tile) {
+        std::vector<BYTE> rgb;
+        rgb.reserve(3 * (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                const BYTE* bgr = film.pixel(x, y);
+                rgb.insert(rgb.end(), { bgr[2], bgr[1], bgr[0] });
+            }
+        std::lock_guard<std::mutex> lock(client.writing);
+        client.writeLine("tile " + std::to_string(tile.x0) + " " + std::to_string(tile.y0) + " " + std::to_string(tile.x1) + " " + std::to_string(tile.y1));
+        client.write(rgb.data(), rgb.size());
+    });
+    film.Render(job.scene, camera);
+    auto stop = std::chrono::high_resolution_clock::now();
+    client.writeLine("done " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count()));
+}
+
+// trace <id> <count>, followed by count RayQuery records: hits line, count RayHit
+// records, done line. The records are read before the id is checked, the stream
+// stays in step either way. They are read a chunk at a time, so memory follows what
+// the client sends rather than the count it claims
+static void trace(Connection& client, const std::unique_ptr<Job>* job, Tokenizer& args)
+{
+    long long count;
+    if (!args.readInt(count) || count < 0)
+    {
+        client.writeLine("error usage: trace <id> <count>");
+        return;
+    }
+    std::vector<RayQuery> rays;
+    for (size_t done = 0; done < (size_t)count;)
+    {
+        size_t n = std::min(TraceChunk, (size_t)count - done);
+        if (job != nullptr) rays.resize(done + n);
+        else rays.resize(n); // dropped
+        if (!client.read(&rays[rays.size() - n], n * sizeof(RayQuery))) return;
+        done += n;
+    }
+    if (job == nullptr)
+    {
+        client.writeLine("error no scene");
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<RayHit> hits(rays.size());
+    traceRays((*job)->scene, rays.data(), hits.data(), rays.size());
+    auto stop = std::chrono::high_resolution_clock::now();
+    client.writeLine("hits " + std::to_string(count));
+    client.write(hits.data(), hits.size() * sizeof(RayHit));
+    client.writeLine("done " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count()));
+}
+
+// one request line, true for quit
+static bool handleRequest(Connection& client, const std::string& line, std::map<std::string, std::unique_ptr<Job>>& scenes, const Options& options)
+{
+    Tokenizer args(line.data(), line.data() + line.size());
+    std::string_view command = args.word();
+    std::string id(args.word());
+    if (command == "load")
+    {
+        std::string filename(args.word());
+        if (id.empty() || filename.empty())
+        {
+            client.writeLine("error usage: load <id> <scene file>");
+            return false;
+        }
+        try
+        {
+            std::unique_ptr<Job> job = loadJob(filename.c_str(), options);
+            client.writeLine("ok " + std::to_string(job->scene.w) + " " + std::to_string(job->scene.h) + " " + std::to_string(job->views.size()));
+            scenes[id] = std::move(job);
+        }
+        catch (int)
+        {
+            client.writeLine("error cannot load " + filename);
+        }
+    }
+    else if (command == "render")
+    {
+        auto found = scenes.find(id);
+        if (found == scenes.end()) client.writeLine("error no scene " + id);
+        else render(client, *found->second, args, options);
+    }
+    else if (command == "trace")
+    {
+        auto found = scenes.find(id);
+        trace(client, found == scenes.end() ? nullptr : &found->second, args);
+    }
+    else if (command == "unload")
+    {
+        if (scenes.erase(id) == 0) client.writeLine("error no scene " + id);
+        else client.writeLine("ok");
+    }
+    else if (command == "list")
+    {
+        std::string reply = "ok";
+        for (const auto& scene : scenes)
+            reply += " " + scene.first;
+        client.writeLine(reply);
+    }
+    else if (command == "quit")
+    {
+        client.writeLine("ok");
+        return true;
+    }
+    else if (!command.empty()) client.writeLine("error unknown request " + std::string(command));
+    return false;
+}
+
+int serve(const char* socketPath, const Options& options)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        std::cerr << "Unable to Start Winsock\n";
+        return 1;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up fails the send instead
+#endif
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket Path Too Long: " << socketPath << "\n";
+        return 1;
+    }
+    memcpy(address.sun_path, socketPath, strlen(socketPath));
+    removeSocketFile(socketPath); // left by a server that did not shut down
+
+    Socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == invalidSocket || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+    {
+        std::cerr << "Unable to Listen on " << socketPath << "\n";
+        if (listener != invalidSocket) closeSocket(listener);
+        return 1;
+    }
+    printf("Serving on %s\n\n", socketPath);
+    fflush(stdout);
+
+    std::map<std::string, std::unique_ptr<Job>> scenes;
+    bool quit = false;
+    while (!quit)
+    {
+        Socket s = accept(listener, nullptr, nullptr);
+        if (s == invalidSocket) continue;
+        Connection client(s);
+        std::string line;
+        while (!quit && client.readLine(line))
+        {
+            // a request that fails midway leaves the stream where it stopped, the client is dropped
+            try
+            {
+                quit = handleRequest(client, line, scenes, options);
+            }
+            catch (const std::exception& e)
+            {
+                client.writeLine(std::string("error ") + e.what());
+                break;
+            }
+            catch (int)
+            {
+                client.writeLine("error request failed");
+                break;
+            }
+        }
+        closeSocket(s);
+    }
+    closeSocket(listener);
+    removeSocketFile(socketPath);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
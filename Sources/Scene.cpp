@@ -1,12 +1,159 @@
+#include <algorithm>
+#include <cmath>
 #include "Scene.hpp"
 
-void Scene::addObject(Object* obj)
+std::vector<uint32_t> Scene::allPrimitives() const
 {
-	Objects.push_back(obj);
+	std::vector<uint32_t> prims(geometry->size());
+	for (uint32_t i = 0; i < prims.size(); i++)
+		prims[i] = i;
+	return prims;
 }
 
-void Scene::buildBVH()
+void Scene::buildAccelerator()
 {
-	printf("-----Generateing BVH...\n\n");
-	this->bvh = new BVHAccel(Objects, 1, BVHAccel::SplitMethod::Naive, vertices);
-}
\ No newline at end of file
+	if (accelerator != nullptr) return; // loaded with a compiled scene
+
+	Accelerator::Type type = acceleratorType;
+	if (type == Accelerator::Type::Auto)
+		type = chooseAccelerator();
+
+	switch (type)
+	{
+	case Accelerator::Type::KdTree:
+		printf("-----Generateing kd-tree...\n\n");
+		accelerator = new KdTreeAccel(geometry, allPrimitives());
+		break;
+	case Accelerator::Type::Grid:
+		printf("-----Generateing Grid...\n\n");
+		accelerator = new GridAccel(geometry, allPrimitives());
+		break;
+	default:
+	{
+		printf("-----Generateing BVH...\n\n");
+		BVHAccel* bvh = new BVHAccel(geometry, allPrimitives(), 1, optimizeBVH);
+		bvh->reorderNodes(bvhLayout);
+		bvh->setTraversal(bvhTraversal);
+		reorderPrimitives(bvh);
+		accelerator = bvh;
+		break;
+	}
+	}
+}
+
+// Pick a structure for the least build + trace time of a single render. The kd-tree
+// traces fastest but its build grows as N log^2 N, so it only gets the smaller scenes.
+// Above that the grid builds in a fraction of the time and wins, unless the objects
+// crowd into a small part of the scene or differ a lot in size, which the BVH handles.
+Accelerator::Type Scene::chooseAccelerator() const
+{
+	const size_t maxKdTreeObjects = 16384;
+	size_t nObjects = geometry->size();
+	if (nObjects < maxKdTreeObjects)
+	{
+		printf("Accelerator: kd-tree (%zu objects)\n\n", nObjects);
+		return Accelerator::Type::KdTree;
+	}
+
+	std::vector<Bbox> objectBounds;
+	objectBounds.reserve(nObjects);
+	Bbox sceneBounds;
+	double sumSize = 0.0, sumSize2 = 0.0;
+	for (uint32_t i = 0; i < nObjects; i++)
+	{
+		objectBounds.push_back(geometry->bounds(i));
+		sceneBounds = i == 0 ? objectBounds[0] : Union(sceneBounds, objectBounds[i]);
+		float size = glm::length(objectBounds[i].Diagonal());
+		sumSize += size;
+		sumSize2 += (double)size * size;
+	}
+	double mean = sumSize / nObjects;
+	double variance = std::max(0.0, sumSize2 / nObjects - mean * mean);
+	float sizeVariation = mean > 0.0 ? (float)(std::sqrt(variance) / mean) : 0.0f;
+
+	// fraction of cells of a coarse grid (8 objects per cell if spread evenly) holding a centroid
+	int res = std::max(1, (int)std::cbrt(nObjects / 8.0));
+	vec3 extent = sceneBounds.Diagonal();
+	std::vector<bool> occupied((size_t)res * res * res, false);
+	for (Bbox& b : objectBounds)
+	{
+		vec3 c = b.Centroid() - sceneBounds.pMin;
+		int cell[3];
+		for (int a = 0; a < 3; a++)
+			cell[a] = extent[a] > 0.0f ? std::min(res - 1, (int)(c[a] / extent[a] * res)) : 0;
+		occupied[((size_t)cell[2] * res + cell[1]) * res + cell[0]] = true;
+	}
+	float occupancy = (float)std::count(occupied.begin(), occupied.end(), true) / occupied.size();
+
+	Accelerator::Type choice = occupancy >= 0.05f && sizeVariation < 2.0f ? Accelerator::Type::Grid : Accelerator::Type::BVH;
+	printf("Accelerator: %s (%zu objects, centroid occupancy %.2f, size variation %.2f)\n\n",
+		choice == Accelerator::Type::Grid ? "grid" : "BVH", nObjects, occupancy, sizeVariation);
+	return choice;
+}
+
+// data[i] = old data[order[i]]
+template <typename T>
+static void permute(T* data, const std::vector<uint32_t>& order)
+{
+	std::vector<T> ordered(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+		ordered[i] = data[order[i]];
+	std::copy(ordered.begin(), ordered.end(), data);
+}
+
+// Renumber the triangles and spheres in BVH leaf order, and the vertices by first use
+// in that order, so neighbouring leaves read neighbouring memory.
+void Scene::reorderPrimitives(BVHAccel* bvh)
+{
+	Geometry& g = *geometry;
+	std::vector<uint32_t> indices, triangleMesh, sphereMaterial;
+	std::vector<Sphere> spheres;
+	indices.reserve(3 * (size_t)g.numTriangles);
+	triangleMesh.reserve(g.numTriangles);
+	spheres.reserve(g.spheres.size());
+	sphereMaterial.reserve(g.spheres.size());
+	std::vector<uint32_t> newId(bvh->primitives.size());
+	for (size_t i = 0; i < bvh->primitives.size(); i++)
+	{
+		uint32_t prim = bvh->primitives[i];
+		if (g.isTriangle(prim))
+		{
+			indices.insert(indices.end(), g.indices + 3 * (size_t)prim, g.indices + 3 * (size_t)prim + 3);
+			triangleMesh.push_back(g.triangleMesh[prim]);
+			newId[i] = (uint32_t)triangleMesh.size() - 1;
+		}
+		else
+		{
+			spheres.push_back(g.sphere(prim));
+			sphereMaterial.push_back(g.sphereMaterial[prim - g.numTriangles]);
+			newId[i] = g.numTriangles + (uint32_t)spheres.size() - 1;
+		}
+	}
+	if (triangleMesh.size() != g.numTriangles || spheres.size() != g.spheres.size())
+		return; // the BVH holds a subset, keep the numbering
+	std::copy(indices.begin(), indices.end(), g.indices);
+	std::copy(triangleMesh.begin(), triangleMesh.end(), g.triangleMesh);
+	g.spheres.swap(spheres);
+	g.sphereMaterial.swap(sphereMaterial);
+	bvh->primitives.swap(newId);
+
+	std::vector<int> newIndex(g.numVertices, -1);
+	std::vector<uint32_t> order; // old index of each new one
+	order.reserve(g.numVertices);
+	for (size_t i = 0; i < 3 * (size_t)g.numTriangles; i++)
+	{
+		uint32_t& v = g.indices[i];
+		if (newIndex[v] < 0)
+		{
+			newIndex[v] = (int)order.size();
+			order.push_back(v);
+		}
+		v = newIndex[v];
+	}
+	// vertices no triangle uses keep their relative order at the end
+	for (uint32_t v = 0; v < g.numVertices; v++)
+		if (newIndex[v] < 0)
+			order.push_back(v);
+	if (g.quantizedVertices != nullptr) permute(g.quantizedVertices, order);
+	else permute(g.vertices, order);
+}
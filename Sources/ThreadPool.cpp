@@ -0,0 +1,107 @@
+#include <algorithm>
+#include "ThreadPool.hpp"
+
+static thread_local bool backgroundThread = false;
+static int globalSize = 0;
+
+ThreadPool::ThreadPool(int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 1; i < nThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers)
+        t.join();
+}
+
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool(globalSize);
+    return pool;
+}
+
+void ThreadPool::setGlobalSize(int nThreads)
+{
+    globalSize = nThreads;
+}
+
+void ThreadPool::setBackground(bool background)
+{
+    backgroundThread = background;
+}
+
+void ThreadPool::runChunks()
+{
+    while (true)
+    {
+        size_t begin = nextIndex.fetch_add(jobGrain);
+        if (begin >= jobCount) break;
+        (*job)(begin, std::min(jobCount, begin + jobGrain));
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    uint64_t seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            busy++;
+        }
+        runChunks();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+        }
+        done.notify_all();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+    if (count == 0) return;
+    grain = std::max<size_t>(1, grain);
+    std::unique_lock<std::mutex> loop(running, std::defer_lock);
+    bool inlineLoop = workers.empty() || count <= grain;
+    if (!inlineLoop)
+    {
+        if (backgroundThread) inlineLoop = !loop.try_lock();
+        else loop.lock();
+    }
+    if (inlineLoop)
+    {
+        for (size_t begin = 0; begin < count; begin += grain)
+            body(begin, std::min(count, begin + grain));
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return busy == 0; });
+        job = &body;
+        jobCount = count;
+        jobGrain = grain;
+        nextIndex = 0;
+        generation++;
+    }
+    wake.notify_all();
+    runChunks();
+
+    // a worker that wakes late finds no chunks left, wait until all have let go of the job
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return busy == 0; });
+    job = nullptr;
+}
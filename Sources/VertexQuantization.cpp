@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "Geometry.hpp"
+#include "ThreadPool.hpp"
+
+const float quantizedSteps = 65535.0f;
+
+void Geometry::quantizeVertices()
+{
+    if (quantizedVertices != nullptr || numVertices == 0) return;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Bbox b(vertices[0], vertices[0]);
+    for (uint32_t v = 1; v < numVertices; v++)
+        b = Union(b, vertices[v]);
+    quantizedOrigin = b.pMin;
+    quantizedScale = b.Diagonal() / quantizedSteps;
+
+    quantizedStorage.resize(numVertices);
+    ThreadPool::global().parallelFor(numVertices, 4096, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                float step = quantizedScale[a] > 0.0f ? std::round((vertices[v][a] - quantizedOrigin[a]) / quantizedScale[a]) : 0.0f;
+                quantizedStorage[v].q[a] = (uint16_t)std::min(std::max(step, 0.0f), quantizedSteps);
+            }
+        }
+    });
+    quantizedVertices = quantizedStorage.data();
+
+    // the float vertices are no longer read, parsed ones are freed, mapped ones stay untouched
+    if (vertices == vertexStorage.data()) std::vector<vec3>().swap(vertexStorage);
+    vertices = nullptr;
+
+    float maxError = 0.5f * std::max(quantizedScale.x, std::max(quantizedScale.y, quantizedScale.z));
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("Quantized Vertices: %u, %zu -> %zu bytes each, max error %g\n", numVertices, sizeof(vec3), sizeof(QuantizedVertex), maxError);
+    printf("Vertex Quantization Time: %lld ms\n\n",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+}
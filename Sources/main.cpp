@@ -1,11 +1,24 @@
 #include <string>
-#include <fstream>
-#include <sstream>
+#include <cstring>
 #include <deque>
 #include <stack>
 #include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "Transform.hpp"
 #include "Film.hpp"
+#include "MappedFile.hpp"
+#include "Tokenizer.hpp"
+#include "ThreadPool.hpp"
+#include "CompiledScene.hpp"
+#include "MeshLoader.hpp"
+#include "Job.hpp"
+#include "RenderServer.hpp"
+#include "Distribute.hpp"
 
 using namespace std;
 
@@ -14,20 +27,17 @@ int width, height; // size
 int maxDepth = 5;
 
 /** Camera **/
-vec3 eye; // The (regularly updated) vector coordinates of the eye 
-vec3 up;  // The (regularly updated) vector coordinates of the up 
-vec3 center;
-float fovy;
+// one per camera command, all rendered from the same geometry and accelerator
+std::vector<View> views;
+string defaultOutput = "RayTraceImage"; // name of unnamed views, without .png
 
 /** Geometry **/
-// vertices
-const int maxNumVertices = 100000;
-vec3 vertices[maxNumVertices];
+// vertices of the vertex commands, sized from the file (maxverts is only a hint)
+std::vector<vec3> vertices;
 int numVertices;
 
 /** Lights **/
 // identifying directional & point depends on the 4th dimention of position
-const int maxNumLights = 10;
 int numLights;
 vec3 attenuation(1, 0, 0);
 
@@ -39,14 +49,29 @@ float shininess;
 float ambient[3] = { 0.2f, 0.2f, 0.2f }; // global ambient
 
 // For multiple objects, read from a file.  
-const int maxNumObjects = 100000;
 int numObjects;
 
-bool readvals(stringstream& s, const int numvals, float* values)
+// the state of the commands back to their defaults, before each scene of a batch
+void resetParseState()
+{
+    width = height = 0;
+    maxDepth = 5;
+    views.clear();
+    defaultOutput = "RayTraceImage";
+    vertices.clear();
+    numVertices = numLights = numObjects = 0;
+    attenuation = vec3(1, 0, 0);
+    for (int a = 0; a < 3; a++) {
+        diffuse[a] = specular[a] = emission[a] = 0.0f;
+        ambient[a] = 0.2f;
+    }
+    shininess = 0.0f;
+}
+
+bool readvals(Tokenizer& s, const int numvals, float* values)
 {
     for (int i = 0; i < numvals; i++) {
-        s >> values[i];
-        if (s.fail()) {
+        if (!s.readFloat(values[i])) {
             cout << "Failed reading value " << i << " will skip\n";
             return false;
         }
@@ -54,256 +79,768 @@ bool readvals(stringstream& s, const int numvals, float* values)
     return true;
 }
 
-const char* readfile(const char* filename, Object* objects, Light* lights)
+// material and transform in effect at a tri command, as indices into the tables of the geometry
+struct ObjectState
 {
-    string str, cmd, outfile;
-    ifstream in;
-    in.open(filename);
-    if (in.is_open()) {
-        stack <mat4> transfstack; // matrix stack to store transforms
-        transfstack.push(mat4(1.0));
-
-        getline(in, str);
-        while (in) {
-            if ((str.find_first_not_of(" \t\r\n") != string::npos) && (str[0] != '#')) { // Ruled out comment and blank lines 
-                stringstream s(str);
-                s >> cmd;
-                int i;
-                float values[10]; // max num of params = 10 (camera)
-                bool validinput; // Validity of input 
-
-                // size command
-                if (cmd == "size") {
-                    validinput = readvals(s, 2, values);
-                    if (validinput) {
-                        width = (int)values[0]; height = (int)values[1];
-                    }
-                }
-                // camera command
-                else if (cmd == "camera") {
-                    validinput = readvals(s, 10, values); // 10 values eye:3 cen:3 up:3 fov:1
-                    if (validinput) {
-                        // eye, lookfrom
-                        eye = vec3(values[0], values[1], values[2]);
-                        // center, lookat
-                        center = vec3(values[3], values[4], values[5]);
-                        // up
-                        up = glm::normalize(vec3(values[6], values[7], values[8]));
-                        up = Transform::upvector(up, center - eye);
-                        // fovy
-                        fovy = values[9];
-                    }
-                }
-                // output command
-                else if (cmd == "output") {
-                    s >> outfile;
-                    if (s.fail()) {
-                        cout << "Failed reading output filename";
-                    }
-                }
-                // maxdepth command
-                else if (cmd == "maxdepth") {
-                    validinput = readvals(s, 1, values);
-                    if (validinput) {
-                        maxDepth = values[0];
-                    }
-                }
-                // directional & point command
-                else if (cmd == "directional" || cmd == "point") {
-                    if (numLights == maxNumLights) { // No more lights 
-                        cerr << "Reached Maximum Number of Lights " << maxNumLights << " Will ignore further lights\n";
-                    }
-                    else {
-                        validinput = readvals(s, 6, values); // Position/color for lts.
-                        if (validinput) {
-                            Light* light = &(lights[numLights]);
-                            light->lightColor = vec3(values[3], values[4], values[5]);
-                            if (cmd == "directional") light->lightPosition = vec4(values[0], values[1], values[2], 0);
-                            else if (cmd == "point") light->lightPosition = vec4(values[0], values[1], values[2], 1);
-                            numLights++;
-                        }
-                    }
-                }
-                // attenuation
-                else if (cmd == "attenuation") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        attenuation = vec3(values[0], values[1], values[2]);
-                    }
-                }
-                // material settings 
-                else if (cmd == "ambient") {
-                    validinput = readvals(s, 3, values); // colors, only 3 values in the given file
-                    if (validinput) {
-                        for (i = 0; i < 3; i++) {
-                            ambient[i] = values[i];
-                        }
-                    }
-                }
-                else if (cmd == "diffuse") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        for (i = 0; i < 3; i++) {
-                            diffuse[i] = values[i];
-                        }
-                    }
-                }
-                else if (cmd == "specular") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        for (i = 0; i < 3; i++) {
-                            specular[i] = values[i];
-                        }
-                    }
-                }
-                else if (cmd == "emission") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        for (i = 0; i < 3; i++) {
-                            emission[i] = values[i];
-                        }
-                    }
-                }
-                else if (cmd == "shininess") {
-                    validinput = readvals(s, 1, values);
-                    if (validinput) {
-                        shininess = values[0];
-                    }
-                }
-                // vertex commands
-                // don't need to deal with maxverts command specifically, 
-                // just focus on vertex commands
-                else if (cmd == "vertex") {
-                    if (numVertices == maxNumVertices) { // No more vertices
-                        cerr << "Reached Maximum Number of Vertices " << maxNumVertices << " Will ignore further vertices\n";
-                    }
-                    else {
-                        validinput = readvals(s, 3, values);
-                        if (validinput) {
-                            vertices[numVertices] = vec3(values[0], values[1], values[2]);
-                            numVertices++;
-                        }
-                    }
-                }
-                // sphere & tri command
-                else if (cmd == "sphere" || cmd == "tri") {
-                    if (numObjects == maxNumObjects) { // No more objects 
-                        cerr << "Reached Maximum Number of Objects " << maxNumObjects << " Will ignore further objects\n";
-                    }
-                    else {
-                        Object* obj = &(objects[numObjects]);
-
-                        // Set the object's material properties
-                        obj->material.emission = vec3(emission[0], emission[1], emission[2]);
-                        obj->material.diffuse = vec3(diffuse[0], diffuse[1], diffuse[2]);
-                        obj->material.specular = vec3(specular[0], specular[1], specular[2]);
-                        obj->material.ambient = vec3(ambient[0], ambient[1], ambient[2]);
-                        obj->material.shininess = shininess;
-
-                        // Set the object's transform
-                        obj->transform = transfstack.top();
-
-                        // Set the object's type
-                        if (cmd == "sphere") {
-                            validinput = readvals(s, 4, values);
-                            if (validinput) {
-                                obj->type = sphere;
-                                obj->centerPosition = vec3(values[0], values[1], values[2]);
-                                obj->Radius = values[3];
-                            }
-                            else {
-                                cerr << "ERROR: Failed reading sphere object";
-                            }
-                        }
-                        else if (cmd == "tri") {
-                            validinput = readvals(s, 3, values);
-                            if (validinput) {
-                                obj->type = triangle;
-                                obj->indices[0] = values[0];
-                                obj->indices[1] = values[1];
-                                obj->indices[2] = values[2];
-                                obj->centerPosition = 1.0f / 3 * (vertices[obj->indices[0]] + vertices[obj->indices[1]] + vertices[obj->indices[2]]);
-                            }
-                            else {
-                                cerr << "ERROR: Failed reading triangle object";
-                            }
-                        }
-                        numObjects++;
-                    }
-                }
-                // transformation commands
-                else if (cmd == "translate") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        mat4 translateMtx = Transform::translate(values[0], values[1], values[2]);
-                        *(&transfstack.top()) = transfstack.top() * translateMtx;
-                    }
-                }
-                else if (cmd == "scale") {
-                    validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        mat4 scaleMtx = Transform::scale(values[0], values[1], values[2]);
-                        *(&transfstack.top()) = transfstack.top() * scaleMtx;
-                    }
-                }
-                else if (cmd == "rotate") {
-                    validinput = readvals(s, 4, values);
-                    if (validinput) {
-                        mat4 rotateMtx = Transform::rotate(values[3], vec3(values[0], values[1], values[2]));
-                        *(&transfstack.top()) = transfstack.top() * rotateMtx;
-                    }
-                }
-                else if (cmd == "pushTransform") transfstack.push(transfstack.top());
-                else if (cmd == "popTransform") {
-                    if (transfstack.size() <= 1) cerr << "Stack has no elements. Cannot Pop\n";
-                    else transfstack.pop();
+    uint32_t material;
+    uint32_t transform;
+};
+
+// tri or sphere command whose arguments are parsed after the sequential pass
+struct DeferredObject
+{
+    const char* args;
+    int state;
+};
+
+// include_mesh command, loaded once the vertices of the scene file are known
+struct MeshInclude
+{
+    string filename;
+    int state;
+};
+
+// mesh paths are relative to the scene file
+string meshPath(const char* sceneFilename, std::string_view mesh)
+{
+    string scene(sceneFilename);
+    size_t slash = scene.find_last_of("/\\");
+    bool absolute = !mesh.empty() && (mesh[0] == '/' || mesh[0] == '\\' || (mesh.size() > 1 && mesh[1] == ':'));
+    if (absolute || slash == string::npos) return string(mesh);
+    return scene.substr(0, slash + 1) + string(mesh);
+}
+
+Material currentMaterial()
+{
+    Material material;
+    material.emission = vec3(emission[0], emission[1], emission[2]);
+    material.diffuse = vec3(diffuse[0], diffuse[1], diffuse[2]);
+    material.specular = vec3(specular[0], specular[1], specular[2]);
+    material.ambient = vec3(ambient[0], ambient[1], ambient[2]);
+    material.shininess = shininess;
+    return material;
+}
+
+// camera command: eye:3 center:3 up:3 fovy:1
+View cameraView(const float* values)
+{
+    View view;
+    view.eye = vec3(values[0], values[1], values[2]);
+    view.center = vec3(values[3], values[4], values[5]);
+    view.up = glm::normalize(vec3(values[6], values[7], values[8]));
+    view.up = Transform::upvector(view.up, view.center - view.eye);
+    view.fovy = values[9];
+    return view;
+}
+
+// an output command names the view of the camera before it, one before any camera
+// names the first. Views left unnamed get a default name, numbered if there are several
+void nameViews(const string& firstOutput)
+{
+    if (views.empty()) views.push_back(View{ vec3(0), vec3(0), vec3(0), 0.0f, "" });
+    if (views[0].output.empty()) views[0].output = firstOutput;
+    for (size_t i = 0; i < views.size(); i++) {
+        if (!views[i].output.empty()) continue;
+        if (views.size() == 1) views[i].output = defaultOutput + ".png";
+        else views[i].output = defaultOutput + "-camera" + std::to_string(i + 1) + ".png";
+    }
+}
+
+// --cameras: camera and output lines as in a scene file, replacing the views of the scene
+void readCameras(const char* filename)
+{
+    MappedFile file;
+    if (!file.open(filename)) {
+        cerr << "Unable to Open Camera File " << filename << "\n";
+        throw 2;
+    }
+    views.clear();
+    string firstOutput;
+    for (const char* line = file.data(); line < file.end(); ) {
+        const char* eol = lineEnd(line, file.end());
+        Tokenizer s(line, eol);
+        line = eol + 1;
+        if (s.empty() || *s.p == '#') continue;
+        std::string_view cmd = s.word();
+        float values[10];
+        if (cmd == "camera") {
+            if (readvals(s, 10, values)) views.push_back(cameraView(values));
+        }
+        else if (cmd == "output") {
+            std::string_view name = s.word();
+            if (name.empty()) cerr << "Failed reading output filename\n";
+            else (views.empty() ? firstOutput : views.back().output) = string(name);
+        }
+        else cerr << "Unknown Command in Camera File: " << cmd << " Skipping\n";
+    }
+    nameViews(firstOutput);
+}
+
+// The file is mapped and walked once in order, running every command that changes
+// state. vertex, tri and sphere lines only get their slot there (vertex order, object
+// order and the state at each object), their numbers are parsed on all threads
+// afterwards. The arrays are sized from what the file holds, there is no upper limit.
+// Materials and transforms go to tables, objects only hold their index. Triangles of
+// one material and transform form a mesh, their vertices are stored in world space,
+// once per transform they are used with.
+void readfile(const char* filename, Geometry& geometry, std::vector<Light>& lights)
+{
+    string firstOutput;
+    MappedFile file;
+    if (!file.open(filename)) {
+        cerr << "Unable to Open Input Data File " << filename << "\n";
+        throw 2;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<const char*> vertexLines;
+    std::vector<DeferredObject> triangleLines, sphereLines;
+    std::vector<MeshInclude> meshIncludes;
+    std::vector<ObjectState> states;
+    bool stateChanged = true;
+
+    stack <mat4> transfstack; // matrix stack to store transforms
+    transfstack.push(mat4(1.0));
+
+    for (const char* line = file.data(); line < file.end(); ) {
+        const char* eol = lineEnd(line, file.end());
+        Tokenizer s(line, eol);
+        line = eol + 1;
+        if (s.empty() || *s.p == '#') continue; // Ruled out comment and blank lines 
+        std::string_view cmd = s.word();
+        int i;
+        float values[10]; // max num of params = 10 (camera)
+        bool validinput; // Validity of input 
+
+        // vertex commands, the most frequent ones first
+        if (cmd == "vertex") vertexLines.push_back(s.p);
+        // sphere & tri command
+        else if (cmd == "tri" || cmd == "sphere") {
+            if (stateChanged) {
+                states.push_back({ geometry.addMaterial(currentMaterial()), geometry.addTransform(transfstack.top()) });
+                stateChanged = false;
+            }
+            (cmd == "tri" ? triangleLines : sphereLines).push_back({ s.p, (int)states.size() - 1 });
+        }
+        // triangle mesh from an OBJ or PLY file, with the current material and transform
+        else if (cmd == "include_mesh") {
+            std::string_view mesh = s.word();
+            if (mesh.empty()) {
+                cerr << "Failed reading mesh filename\n";
+            }
+            else {
+                if (stateChanged) {
+                    states.push_back({ geometry.addMaterial(currentMaterial()), geometry.addTransform(transfstack.top()) });
+                    stateChanged = false;
                 }
-                else if (cmd == "maxverts") {// Do nothing;
+                meshIncludes.push_back({ meshPath(filename, mesh), (int)states.size() - 1 });
+            }
+        }
+        // size command
+        else if (cmd == "size") {
+            validinput = readvals(s, 2, values);
+            if (validinput) {
+                width = (int)values[0]; height = (int)values[1];
+            }
+        }
+        // camera command, each one is a view
+        else if (cmd == "camera") {
+            validinput = readvals(s, 10, values); // 10 values eye:3 cen:3 up:3 fov:1
+            if (validinput) views.push_back(cameraView(values));
+        }
+        // output command
+        else if (cmd == "output") {
+            std::string_view name = s.word();
+            if (name.empty()) {
+                cout << "Failed reading output filename";
+            }
+            else (views.empty() ? firstOutput : views.back().output) = string(name);
+        }
+        // maxdepth command
+        else if (cmd == "maxdepth") {
+            validinput = readvals(s, 1, values);
+            if (validinput) {
+                maxDepth = values[0];
+            }
+        }
+        // directional & point command
+        else if (cmd == "directional" || cmd == "point") {
+            validinput = readvals(s, 6, values); // Position/color for lts.
+            if (validinput) {
+                Light light;
+                light.lightColor = vec3(values[3], values[4], values[5]);
+                if (cmd == "directional") light.lightPosition = vec4(values[0], values[1], values[2], 0);
+                else if (cmd == "point") light.lightPosition = vec4(values[0], values[1], values[2], 1);
+                lights.push_back(light);
+            }
+        }
+        // attenuation
+        else if (cmd == "attenuation") {
+            validinput = readvals(s, 3, values);
+            if (validinput) {
+                attenuation = vec3(values[0], values[1], values[2]);
+            }
+        }
+        // material settings 
+        else if (cmd == "ambient" || cmd == "diffuse" || cmd == "specular" || cmd == "emission") {
+            validinput = readvals(s, 3, values); // colors, only 3 values in the given file
+            if (validinput) {
+                float* color = cmd == "ambient" ? ambient : cmd == "diffuse" ? diffuse : cmd == "specular" ? specular : emission;
+                for (i = 0; i < 3; i++) {
+                    color[i] = values[i];
                 }
-                else cerr << "Unknown Command: " << cmd << " Skipping \n";
+                stateChanged = true;
             }
-            getline(in, str);
         }
+        else if (cmd == "shininess") {
+            validinput = readvals(s, 1, values);
+            if (validinput) {
+                shininess = values[0];
+                stateChanged = true;
+            }
+        }
+        // transformation commands
+        else if (cmd == "translate") {
+            validinput = readvals(s, 3, values);
+            if (validinput) {
+                mat4 translateMtx = Transform::translate(values[0], values[1], values[2]);
+                *(&transfstack.top()) = transfstack.top() * translateMtx;
+                stateChanged = true;
+            }
+        }
+        else if (cmd == "scale") {
+            validinput = readvals(s, 3, values);
+            if (validinput) {
+                mat4 scaleMtx = Transform::scale(values[0], values[1], values[2]);
+                *(&transfstack.top()) = transfstack.top() * scaleMtx;
+                stateChanged = true;
+            }
+        }
+        else if (cmd == "rotate") {
+            validinput = readvals(s, 4, values);
+            if (validinput) {
+                mat4 rotateMtx = Transform::rotate(values[3], vec3(values[0], values[1], values[2]));
+                *(&transfstack.top()) = transfstack.top() * rotateMtx;
+                stateChanged = true;
+            }
+        }
+        else if (cmd == "pushTransform") transfstack.push(transfstack.top());
+        else if (cmd == "popTransform") {
+            if (transfstack.size() <= 1) cerr << "Stack has no elements. Cannot Pop\n";
+            else {
+                transfstack.pop();
+                stateChanged = true;
+            }
+        }
+        else if (cmd == "maxverts") {
+            validinput = readvals(s, 1, values);
+            // a vertex command takes 13 bytes at least, a larger hint cannot be right
+            size_t mostVertices = file.size() / 13;
+            if (validinput && values[0] > 0) vertexLines.reserve(std::min((size_t)std::min(values[0], 4e9f), mostVertices));
+        }
+        else cerr << "Unknown Command: " << cmd << " Skipping \n";
     }
-    else {
-        cerr << "Unable to Open Input Data File " << filename << "\n";
-        throw 2;
+
+    // vertices first, the tris read them for their center
+    ThreadPool& pool = ThreadPool::global();
+    std::vector<char> vertexValid(vertexLines.size());
+    vertices.resize(vertexLines.size());
+    pool.parallelFor(vertexLines.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            Tokenizer s(vertexLines[v], lineEnd(vertexLines[v], file.end()));
+            float values[3];
+            vertexValid[v] = readvals(s, 3, values);
+            if (vertexValid[v]) vertices[v] = vec3(values[0], values[1], values[2]);
+        }
+    });
+    // a vertex that failed to read takes no index, like in a sequential read
+    numVertices = 0;
+    for (size_t v = 0; v < vertexLines.size(); v++)
+        if (vertexValid[v]) vertices[numVertices++] = vertices[v];
+    vertices.resize(numVertices);
+
+    std::vector<char> sphereValid(sphereLines.size());
+    std::vector<Sphere>& spheres = geometry.spheres;
+    std::vector<uint32_t>& sphereMaterial = geometry.sphereMaterial;
+    spheres.resize(sphereLines.size());
+    sphereMaterial.resize(sphereLines.size());
+    pool.parallelFor(sphereLines.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t o = begin; o < end; o++) {
+            const DeferredObject& line = sphereLines[o];
+            Tokenizer s(line.args, lineEnd(line.args, file.end()));
+            Sphere* obj = &(spheres[o]);
+            // Set the object's material properties and transform
+            sphereMaterial[o] = states[line.state].material;
+            obj->transform = states[line.state].transform;
+
+            float values[4];
+            sphereValid[o] = readvals(s, 4, values);
+            if (sphereValid[o]) {
+                obj->centerPosition = vec3(values[0], values[1], values[2]);
+                obj->Radius = values[3];
+            }
+            else {
+                cerr << "ERROR: Failed reading sphere object\n";
+            }
+        }
+    });
+
+    std::vector<char> triangleValid(triangleLines.size());
+    std::vector<uint32_t> triangleVertices(3 * triangleLines.size());
+    pool.parallelFor(triangleLines.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            Tokenizer s(triangleLines[t].args, lineEnd(triangleLines[t].args, file.end()));
+            float values[3];
+            triangleValid[t] = readvals(s, 3, values);
+            for (int k = 0; k < 3 && triangleValid[t]; k++) {
+                int index = (int)values[k];
+                triangleValid[t] = index >= 0 && index < numVertices;
+                triangleVertices[3 * t + k] = (uint32_t)index;
+            }
+            if (!triangleValid[t]) cerr << "ERROR: Failed reading triangle object\n";
+        }
+    });
+
+    // objects that failed to read are dropped
+    size_t nSpheres = 0;
+    for (size_t o = 0; o < spheres.size(); o++)
+        if (sphereValid[o]) {
+            sphereMaterial[nSpheres] = sphereMaterial[o];
+            spheres[nSpheres++] = spheres[o];
+        }
+    spheres.resize(nSpheres);
+    sphereMaterial.resize(nSpheres);
+
+    std::unordered_map<uint64_t, uint32_t> meshIds; // material << 32 | transform
+    auto meshOf = [&](int state) {
+        uint64_t key = (uint64_t)states[state].material << 32 | states[state].transform;
+        auto it = meshIds.emplace(key, (uint32_t)geometry.meshes.size()).first;
+        if (it->second == geometry.meshes.size())
+            geometry.meshes.push_back({ states[state].material, states[state].transform });
+        return it->second;
+    };
+    std::vector<vec3>& worldVertices = geometry.vertexStorage;
+    std::vector<uint32_t>& indices = geometry.indexStorage;
+    std::vector<uint32_t>& triangleMesh = geometry.triangleMeshStorage;
+    std::unordered_map<uint64_t, uint32_t> worldIndex; // transform << 32 | vertex
+    for (size_t t = 0; t < triangleLines.size(); t++) {
+        if (!triangleValid[t]) continue;
+        const ObjectState& state = states[triangleLines[t].state];
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = triangleVertices[3 * t + k];
+            auto it = worldIndex.emplace((uint64_t)state.transform << 32 | v, (uint32_t)worldVertices.size()).first;
+            if (it->second == worldVertices.size())
+                worldVertices.push_back(vec3(geometry.transforms[state.transform] * vec4(vertices[v], 1)));
+            indices.push_back(it->second);
+        }
+        triangleMesh.push_back(meshOf(triangleLines[t].state));
+    }
+
+    // mesh vertices go after those of the file, their triangles after its tris
+    for (const MeshInclude& mesh : meshIncludes) {
+        size_t firstVertex = worldVertices.size(), firstIndex = indices.size();
+        if (!loadMesh(mesh.filename.c_str(), worldVertices, indices)) {
+            cerr << "Skipping Mesh " << mesh.filename << "\n";
+            continue;
+        }
+        size_t nTriangles = (indices.size() - firstIndex) / 3;
+        printf("Mesh %s: %zu triangles\n", mesh.filename.c_str(), nTriangles);
+        const mat4& transform = geometry.transforms[states[mesh.state].transform];
+        pool.parallelFor(worldVertices.size() - firstVertex, 4096, [&](size_t begin, size_t end) {
+            for (size_t v = firstVertex + begin; v < firstVertex + end; v++)
+                worldVertices[v] = vec3(transform * vec4(worldVertices[v], 1));
+        });
+        triangleMesh.resize(triangleMesh.size() + nTriangles, meshOf(mesh.state));
     }
+    geometry.useStorage();
+    numVertices = (int)geometry.numVertices;
+    numObjects = (int)geometry.size();
+    numLights = (int)lights.size();
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    printf("Scene Parsing Time: %lld ms\n\n", (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+
     if (!maxDepth) maxDepth = 1;
+    nameViews(firstOutput);
+}
+
+void readOptions(int argc, char* argv[], int first, Options& options)
+{
+    bool bvhOptions = false;
+    for (int i = first; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--bvh-optimize" || arg == "--bvh-layout" || arg == "--traversal") bvhOptions = true;
+        if (arg == "--bvh-optimize") options.optimizeBVH = true;
+        else if (arg == "--clean-geometry") options.cleanGeometry = true;
+        else if (arg == "--quantize-vertices") options.quantizeVertices = true;
+        else if (arg == "--progressive") options.progressive = true;
+        else if (arg == "--time-budget" && i + 1 < argc) options.timeBudget = (float)atof(argv[++i]), options.progressive = true;
+        else if (arg == "--preview-interval" && i + 1 < argc) options.previewInterval = (float)atof(argv[++i]), options.progressive = true;
+        else if (arg == "--tile-schedule" && i + 1 < argc) options.costSchedule = std::string(argv[++i]) != "scan";
+        else if (arg == "--tile-order" && i + 1 < argc) {
+            string order = argv[++i];
+            if (order == "scan") options.tileOrder = Film::TileOrder::Scan;
+            else if (order == "hilbert") options.tileOrder = Film::TileOrder::Hilbert;
+            else cerr << "Unknown Tile Order: " << order << " Using scan\n";
+        }
+        else if (arg == "--pixel-order" && i + 1 < argc) {
+            string order = argv[++i];
+            if (order == "scan") options.pixelOrder = Film::PixelOrder::Scan;
+            else if (order == "morton") options.pixelOrder = Film::PixelOrder::Morton;
+            else cerr << "Unknown Pixel Order: " << order << " Using scan\n";
+        }
+        else if (arg == "--aa" && i + 1 < argc) options.aaMaxSamples = std::max(1, atoi(argv[++i]));
+        else if (arg == "--aa-threshold" && i + 1 < argc) options.aaThreshold = (float)atof(argv[++i]);
+        else if (arg == "--memory-budget" && i + 1 < argc) options.memoryBudget = (size_t)(atof(argv[++i]) * (1 << 20));
+        else if (arg == "--compile" && i + 1 < argc) options.compileTo = argv[++i];
+        else if (arg == "--checkpoint" && i + 1 < argc) options.checkpointInterval = (float)atof(argv[++i]);
+        else if (arg == "--resume") options.resume = true;
+        else if (arg == "--region" && i + 4 < argc) {
+            options.region = { atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4]) };
+            if (options.region.x1 > options.region.x0 && options.region.y1 > options.region.y0) options.partial = true;
+            else cerr << "Unknown Region: " << argv[i + 1] << " " << argv[i + 2] << " " << argv[i + 3] << " " << argv[i + 4] << " Rendering the whole image\n";
+            i += 4;
+        }
+        else if (arg == "--tile" && i + 1 < argc) {
+            string tile = argv[++i];
+            if (sscanf(tile.c_str(), "%d/%d", &options.tileIndex, &options.tileCount) == 2
+                && options.tileIndex >= 0 && options.tileIndex < options.tileCount) options.partial = true;
+            else cerr << "Unknown Tile: " << tile << " Rendering the whole image\n";
+        }
+        else if (arg == "--cameras" && i + 1 < argc) options.camerasFile = argv[++i];
+        else if (arg == "--bvh-layout" && i + 1 < argc) {
+            string layout = argv[++i];
+            if (layout == "dfs") options.bvhLayout = BVHAccel::NodeLayout::DepthFirst;
+            else if (layout == "veb") options.bvhLayout = BVHAccel::NodeLayout::VanEmdeBoas;
+            else cerr << "Unknown BVH Layout: " << layout << " Using veb\n";
+        }
+        else if (arg == "--traversal" && i + 1 < argc) {
+            string mode = argv[++i];
+            if (mode == "stack") options.bvhTraversal = BVHAccel::Traversal::Stack;
+            else if (mode == "stackless") options.bvhTraversal = BVHAccel::Traversal::Stackless;
+            else cerr << "Unknown Traversal: " << mode << " Using stack\n";
+        }
+        else if (arg == "--threads" && i + 1 < argc) options.threads = std::max(0, atoi(argv[++i]));
+        else if (arg == "--accel" && i + 1 < argc) {
+            string accel = argv[++i];
+            if (accel == "bvh") options.acceleratorType = Accelerator::Type::BVH;
+            else if (accel == "kdtree") options.acceleratorType = Accelerator::Type::KdTree;
+            else if (accel == "grid") options.acceleratorType = Accelerator::Type::Grid;
+            else if (accel == "auto") options.acceleratorType = Accelerator::Type::Auto;
+            else cerr << "Unknown Accelerator: " << accel << " Using auto\n";
+        }
+        else cerr << "Unknown Option: " << arg << " Skipping \n";
+    }
+    // the BVH options ask for the BVH, auto would pick the kd-tree or grid for most scenes
+    if (bvhOptions && options.acceleratorType == Accelerator::Type::Auto) options.acceleratorType = Accelerator::Type::BVH;
+    else if (bvhOptions && options.acceleratorType != Accelerator::Type::BVH) cerr << "BVH Options Ignored, the Accelerator is not the BVH\n";
+    ThreadPool::setGlobalSize(options.threads);
+}
+
+// parses or maps the scene file and builds its accelerator. Uses the parser globals,
+// so one scene is loaded at a time
+std::unique_ptr<Job> loadJob(const char* filename, const Options& options)
+{
+    std::unique_ptr<Job> job(new Job);
+    job->filename = filename;
+    Geometry& geometry = job->geometry;
+    CompiledScene& compiled = job->compiled;
+    resetParseState();
+    if (options.outputPerScene) {
+        string stem = filename;
+        stem = stem.substr(stem.find_last_of("/\\") + 1);
+        defaultOutput = stem.substr(0, stem.find_last_of('.'));
+    }
+    if (compiled.open(filename)) compiled.load(geometry, job->lights);
+    else readfile(filename, geometry, job->lights);
+    if (!options.camerasFile.empty()) readCameras(options.camerasFile.c_str());
+    job->views = std::move(views);
+
+    Scene& scene = job->scene;
+    scene = Scene(width, height);
+    scene.maxDepth = maxDepth;
+    scene.attenuation = attenuation;
+    scene.acceleratorType = options.acceleratorType;
+    scene.optimizeBVH = options.optimizeBVH;
+    scene.bvhLayout = options.bvhLayout;
+    scene.bvhTraversal = options.bvhTraversal;
+    // a compiled scene stores a BVH
+    if (!options.compileTo.empty() && scene.acceleratorType == Accelerator::Type::Auto) scene.acceleratorType = Accelerator::Type::BVH;
+
+    for (const View& view : job->views)
+        cout << "Running Ray-Tracing for " << view.output << std::endl;
+    cout << std::endl;
+
+    if (options.cleanGeometry) {
+        geometry.cleanup();
+        numVertices = (int)geometry.numVertices;
+        numObjects = (int)geometry.size();
+    }
+    if (options.quantizeVertices) geometry.quantizeVertices();
+    scene.geometry = &geometry;
+    scene.lights = job->lights.data();
+    scene.numLights = (int)job->lights.size();
+
+    // a stored BVH saves the build, it is used unless another accelerator is asked for
+    // or the cleanup renumbered the primitives it refers to, or the vertices moved
+    if (compiled.isOpen() && compiled.hasBVH() && !options.cleanGeometry && !options.quantizeVertices
+        && (scene.acceleratorType == Accelerator::Type::Auto || scene.acceleratorType == Accelerator::Type::BVH)) {
+        BVHAccel* bvh = compiled.createBVH(&geometry);
+        bvh->setTraversal(scene.bvhTraversal);
+        scene.accelerator = bvh;
+        // only the stored BVH reads its nodes from the file, a rebuilt one is in memory
+        if (options.memoryBudget > 0) compiled.streamGeometry(geometry, options.memoryBudget);
+    }
+    if (options.memoryBudget > 0 && compiled.pages() == nullptr)
+        cerr << "--memory-budget needs a compiled scene used with its BVH, ignored\n";
+
+    scene.buildAccelerator();
+    return job;
+}
+
+Tile partRegion(const Options& options, int w, int h)
+{
+    Tile region = { 0, 0, w, h };
+    if (options.tileCount > 0)
+        region = { 0, (int)((long long)options.tileIndex * h / options.tileCount), w, (int)((long long)(options.tileIndex + 1) * h / options.tileCount) };
+    else if (options.partial)
+        region = options.region;
+    return { std::max(region.x0, 0), std::max(region.y0, 0), std::min(region.x1, w), std::min(region.y1, h) };
+}
+
+std::string partFilename(const std::string& output, const Tile& region)
+{
+    return output + "." + std::to_string(region.x0) + "-" + std::to_string(region.y0) + "-"
+        + std::to_string(region.x1) + "-" + std::to_string(region.y1) + ".ppm";
+}
+
+void applyOptions(Film& film, const Options& options)
+{
+    if (options.progressive) film.setProgressive(options.timeBudget, options.previewInterval);
+    film.setTileSchedule(options.costSchedule);
+    film.setOrder(options.tileOrder, options.pixelOrder);
+    film.setAntiAliasing(options.aaMaxSamples, options.aaThreshold);
+}
+
+static void requestStop(int)
+{
+    Film::stopRequested = 1;
+}
+
+// FNV-1a of the file's bytes, 8 at a time, that checkpoints are matched to
+static uint64_t fileHash(const char* filename)
+{
+    MappedFile file;
+    uint64_t hash = 14695981039346656037ull;
+    if (!file.open(filename)) return hash;
+    size_t words = file.size() / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, file.data() + 8 * i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (const char* p = file.data() + 8 * words; p < file.end(); p++)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+    return hash;
+}
+
+// every view is traced on the thread pool with the one accelerator
+bool renderJob(Job& job, const Options& options)
+{
+    const bool checkpoints = options.checkpointInterval > 0.0f || options.resume;
+    uint64_t sceneHash = 0;
+    if (checkpoints) {
+        // a preempted machine gets a last checkpoint out
+        signal(SIGTERM, requestStop);
+        signal(SIGINT, requestStop);
+        sceneHash = fileHash(job.filename.c_str());
+    }
+    const std::vector<View>& views = job.views;
+    for (size_t i = 0; i < views.size() && !Film::stopRequested; i++) {
+        const View& view = views[i];
+        if (views.size() > 1) printf("-----Rendering View %zu of %zu: %s\n\n", i + 1, views.size(), view.output.c_str());
+        Camera camera(view.eye, view.center, view.up, view.fovy, job.scene.w, job.scene.h);
+        Film film = Film(job.scene.w, job.scene.h);
+        applyOptions(film, options);
+        Tile region = partRegion(options, job.scene.w, job.scene.h);
+        if (region.x1 <= region.x0 || region.y1 <= region.y0) {
+            cerr << "Region " << options.region.x0 << " " << options.region.y0 << " " << options.region.x1 << " " << options.region.y1
+                << " is Outside the " << job.scene.w << "x" << job.scene.h << " Image\n";
+            throw 2;
+        }
+        string checkpoint = (options.partial ? partFilename(view.output, region) : view.output) + ".checkpoint";
+        if (checkpoints) film.setCheckpoint(checkpoint.c_str(), options.checkpointInterval > 0.0f ? options.checkpointInterval : 60.0f, options.resume, sceneHash, view);
+        if (!options.partial) {
+            film.setOutputFilename(view.output.c_str());
+            film.Render(job.scene, camera);
+        }
+        else {
+            film.setRegion(region);
+            film.Render(job.scene, camera);
+            string part = partFilename(view.output, region);
+            if (!film.WritePart(part.c_str())) {
+                cerr << "Unable to Write Partial Framebuffer " << part << "\n";
+                throw 2;
+            }
+        }
+        if (i + 1 < views.size()) printf("\n");
+    }
+    if (job.compiled.pages() != nullptr) job.compiled.pages()->printStats();
+    return !Film::stopRequested;
+}
+
+// scene files of a batch: plain arguments, and the lines of @manifest arguments
+std::vector<string> batchScenes(const std::vector<string>& args)
+{
+    std::vector<string> scenes;
+    for (const string& arg : args) {
+        if (arg[0] != '@') {
+            scenes.push_back(arg);
+            continue;
+        }
+        MappedFile file;
+        if (!file.open(arg.c_str() + 1)) {
+            cerr << "Unable to Open Batch Manifest " << arg.c_str() + 1 << "\n";
+            continue;
+        }
+        for (const char* line = file.data(); line < file.end(); ) {
+            const char* eol = lineEnd(line, file.end());
+            Tokenizer s(line, eol);
+            line = eol + 1;
+            if (s.empty() || *s.p == '#') continue;
+            std::string_view scene = s.word();
+            scenes.push_back(meshPath(arg.c_str() + 1, scene));
+        }
+    }
+    return scenes;
+}
+
+// --batch: a loader thread parses the next scene and builds its accelerator while the
+// current one renders. It runs as a background thread of the pool, so the render keeps
+// all threads. One scene waits loaded at most, finished scenes are freed
+int renderBatch(const std::vector<string>& scenes, const Options& options)
+{
+    std::mutex queueLock;
+    std::condition_variable queueChanged;
+    std::deque<std::unique_ptr<Job>> loaded; // nullptr for a scene that failed to load
+
+    std::thread loader([&] {
+        ThreadPool::setBackground(true);
+        for (size_t i = 0; i < scenes.size(); i++) {
+            {
+                std::unique_lock<std::mutex> lock(queueLock);
+                queueChanged.wait(lock, [&] { return loaded.empty(); });
+            }
+            std::unique_ptr<Job> job;
+            try {
+                if (!Film::stopRequested) job = loadJob(scenes[i].c_str(), options);
+            }
+            catch (int) {
+                cerr << "Failed Loading " << scenes[i] << " Skipping\n";
+            }
+            std::lock_guard<std::mutex> lock(queueLock);
+            loaded.push_back(std::move(job));
+            queueChanged.notify_all();
+        }
+    });
 
-    if (outfile.empty()) return "RayTraceImage.png";
-    else return _strdup(outfile.c_str());
+    int failed = 0;
+    for (size_t taken = 0; taken < scenes.size(); taken++) {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            queueChanged.wait(lock, [&] { return !loaded.empty(); });
+            job = std::move(loaded.front());
+            loaded.pop_front();
+            queueChanged.notify_all();
+        }
+        printf("-----Batch Scene %zu of %zu: %s\n\n", taken + 1, scenes.size(), scenes[taken].c_str());
+        if (job == nullptr || Film::stopRequested) {
+            failed++;
+            continue;
+        }
+        try {
+            if (!renderJob(*job, options)) failed++;
+        }
+        catch (int) {
+            failed++;
+        }
+        printf("\n");
+    }
+    loader.join();
+    printf("Batch Finished: %zu scenes rendered, %i failed\n", scenes.size() - failed, failed);
+    return failed == 0 ? 0 : 1;
 }
 
 int main(int argc, char* argv[])
 {
     auto start_time = std::chrono::high_resolution_clock::now();
-    Object* objects = new Object[maxNumObjects];
-    Light* lights = new Light[maxNumLights];
-    const char* outputFilename = readfile(argv[1], objects, lights);
-    
-    cout << "Running Ray-Tracing for " << outputFilename << std::endl << std::endl;
-    
-    Scene scene = Scene(width, height);
-
-    for (int i = 0; i < numObjects; i++)
-        scene.addObject(&objects[i]);
-
-    scene.vertices = vertices;
-    scene.lights = lights;
-
-    Camera camera(eye, center, up, fovy, scene.w, scene.h);
-    Film film = Film(scene.w, scene.h);
-    film.setOutputFilename(outputFilename);
-    film.Render(scene, camera);
+    if (argc < 2) {
+        cerr << "Usage: HeliosHunter <scene> [options], HeliosHunter --batch <scenes or @manifests> [options]"
+            ", HeliosHunter --serve <socket> [options] or HeliosHunter --distribute <workers> <scene> [options]\n";
+        return 1;
+    }
+
+    if (string(argv[1]) == "--serve" && argc >= 3) {
+        Options options;
+        readOptions(argc, argv, 3, options);
+        options.compileTo.clear();
+        return serve(argv[2], options);
+    }
+
+    if (string(argv[1]) == "--distribute" && argc >= 4) {
+        Options options;
+        readOptions(argc, argv, 4, options);
+        if (!options.compileTo.empty() || options.partial) {
+            cerr << "--compile, --region and --tile do not go with --distribute\n";
+            return 1;
+        }
+        return distribute(argv[0], atoi(argv[2]), argv[3], std::vector<string>(argv + 4, argv + argc), options);
+    }
+
+    if (string(argv[1]) == "--batch") {
+        std::vector<string> args;
+        int first = 2;
+        for (; first < argc && string(argv[first]).compare(0, 2, "--") != 0; first++)
+            args.push_back(argv[first]);
+        Options options;
+        options.outputPerScene = true;
+        readOptions(argc, argv, first, options);
+        if (!options.compileTo.empty()) {
+            cerr << "--compile is for one scene, ignored in a batch\n";
+            options.compileTo.clear();
+        }
+        int status = renderBatch(batchScenes(args), options);
+
+        auto end_time = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
+        std::cout << "Time taken: " << duration.count() << "seconds" << std::endl;
+        return status;
+    }
+
+    Options options;
+    readOptions(argc, argv, 2, options);
+    std::unique_ptr<Job> job = loadJob(argv[1], options);
+    if (!options.compileTo.empty())
+        return CompiledScene::write(options.compileTo.c_str(), job->scene, job->views) ? 0 : 1;
+
+    try {
+        if (!renderJob(*job, options)) {
+            printf("\nRay Tracing Stopped, continue with --resume\n");
+            return 1;
+        }
+    }
+    catch (int) {
+        return 1;
+    }
     printf("\nRay Tracing Finished!\nPlease check the output file!\n");
 
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
     std::cout << "Time taken: " << duration.count() << "seconds" << std::endl;
 
-    delete[] objects;
-    cin.get();
+    // a part is rendered by a coordinator or a farm, nobody is watching
+    if (!options.partial) cin.get();
 
     return 0;
-}
\ No newline at end of file
+}